@@ -25,6 +25,31 @@
  */
 
 #include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#ifdef PACKETMACHINE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef PACKETMACHINE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef PACKETMACHINE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef __linux__
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#endif
+
 #include "./capture.hpp"
 #include "./packet.hpp"
 
@@ -32,12 +57,126 @@
 
 namespace pm {
 
-Capture::Capture() : ready_(false) {
+Capture::Capture() : ready_(false), queue_(0) {
 }
 
 Capture::~Capture() {
 }
 
+Capture::Result Capture::read_batch(Packet** pkts, size_t n, size_t* count) {
+  Result rc = NONE;
+  size_t i = 0;
+
+  while (i < n && OK == (rc = this->read(pkts[i]))) {
+    i++;
+  }
+
+  *count = i;
+  return (i > 0) ? OK : rc;
+}
+
+bool Capture::set_filter(const std::string& expr) {
+  std::string err;
+  auto bpf = Capture::compile_filter(expr, &err);
+  if (!bpf) {
+    this->set_error(err);
+    return false;
+  }
+
+  this->bpf_ = bpf;
+  return true;
+}
+
+static std::shared_ptr<struct bpf_program>
+pcap_compile_filter(pcap_t* pd, const std::string& expr, std::string* err) {
+  struct bpf_program* prog = new struct bpf_program;
+  if (::pcap_compile(pd, prog, expr.c_str(), 1, PCAP_NETMASK_UNKNOWN) != 0) {
+    *err = ::pcap_geterr(pd);
+    delete prog;
+    return nullptr;
+  }
+
+  return std::shared_ptr<struct bpf_program>(prog, [](struct bpf_program* p) {
+      ::pcap_freecode(p);
+      delete p;
+    });
+}
+
+std::shared_ptr<struct bpf_program>
+Capture::compile_filter(const std::string& expr, std::string* err) {
+  // Decoder handles only Ethernet frames.
+  pcap_t* pd = ::pcap_open_dead(DLT_EN10MB, 0xffff);
+  if (pd == nullptr) {
+    *err = "fail to open pcap to compile filter";
+    return nullptr;
+  }
+
+  auto bpf = pcap_compile_filter(pd, expr, err);
+  ::pcap_close(pd);
+  return bpf;
+}
+
+bool Capture::match_filter(const Packet* pkt) const {
+  struct pcap_pkthdr hdr;
+  hdr.ts = pkt->tv();
+  hdr.caplen = static_cast<bpf_u_int32>(pkt->len());
+  hdr.len = static_cast<bpf_u_int32>(pkt->len());
+  return (::pcap_offline_filter(this->bpf_.get(), &hdr, pkt->buf()) != 0);
+}
+
+// Compile and install filter with pcap_setfilter() so that libpcap (or the
+// kernel for live capture) drops packets before they are copied.
+static bool pcap_install_filter(pcap_t* pd, const std::string& expr,
+                                std::string* err) {
+  struct bpf_program prog;
+  if (::pcap_compile(pd, &prog, expr.c_str(), 1, PCAP_NETMASK_UNKNOWN) != 0) {
+    *err = ::pcap_geterr(pd);
+    return false;
+  }
+
+  bool rc = (::pcap_setfilter(pd, &prog) == 0);
+  if (!rc) {
+    *err = ::pcap_geterr(pd);
+  }
+  ::pcap_freecode(&prog);
+  return rc;
+}
+
+
+// Context of pcap_dispatch() to store packets into slots.
+struct PcapBatch {
+  Packet** pkts;
+  size_t count;
+  bool alloc_error;
+};
+
+static void pcap_batch_handler(u_char* user, const struct pcap_pkthdr* hdr,
+                               const u_char* data) {
+  PcapBatch* batch = reinterpret_cast<PcapBatch*>(user);
+  Packet* pkt = batch->pkts[batch->count];
+
+  // libpcap reuses own buffer, then data must be copied.
+  if (batch->alloc_error || pkt->store(data, hdr->caplen) == false) {
+    batch->alloc_error = true;
+    return;
+  }
+
+  pkt->set_cap_len(hdr->caplen);
+  pkt->set_tv(hdr->ts);
+  batch->count++;
+}
+
+// Read packets with pcap_dispatch() and return result of pcap_dispatch().
+static int pcap_read_batch(pcap_t* pd, Packet** pkts, size_t n,
+                           PcapBatch* batch) {
+  batch->pkts = pkts;
+  batch->count = 0;
+  batch->alloc_error = false;
+
+  return ::pcap_dispatch(pd, static_cast<int>(n), pcap_batch_handler,
+                         reinterpret_cast<u_char*>(batch));
+}
+
 
 
 PcapDev::PcapDev(const std::string &dev_name) :
@@ -102,6 +241,58 @@ Capture::Result PcapDev::read(Packet* pkt) {
 
 
 
+Capture::Result PcapDev::read_batch(Packet** pkts, size_t n, size_t* count) {
+  PcapBatch batch;
+  *count = 0;
+
+  if (!this->ready()) {
+    this->set_error("pcap is not ready");
+    return ERROR;
+  }
+
+  int rc = pcap_read_batch(this->pd_, pkts, n, &batch);
+  *count = batch.count;
+
+  if (batch.alloc_error) {
+    *count = 0;
+    this->set_error("memory allocation error");
+    return ERROR;
+  } else if (rc > 0) {
+    return OK;
+  } else if (rc == 0) {
+    // timeout expired and no packet.
+    return NONE;
+  } else if (rc == -1) {
+    this->set_error(pcap_geterr(this->pd_));
+    this->set_ready(false);
+    return ERROR;
+  } else {
+    // pcap_breakloop() was called.
+    this->set_ready(false);
+    return EXIT;
+  }
+}
+
+bool PcapDev::set_filter(const std::string& expr) {
+  std::string err;
+  if (!pcap_install_filter(this->pd_, expr, &err)) {
+    this->set_error(err);
+    return false;
+  }
+  return true;
+}
+
+int PcapDev::selectable_fd() {
+  // pcap_dispatch() must not block for timeout while the fd is waited on.
+  char errbuf[PCAP_ERRBUF_SIZE];
+  if (::pcap_setnonblock(this->pd_, 1, errbuf) != 0) {
+    return -1;
+  }
+  return ::pcap_get_selectable_fd(this->pd_);
+}
+
+
+
 PcapFile::PcapFile(const std::string &file_path) :
     file_path_(file_path),
     pd_(nullptr) {
@@ -162,4 +353,1313 @@ Capture::Result PcapFile::read(Packet* pkt) {
 }
 
 
+
+Capture::Result PcapFile::read_batch(Packet** pkts, size_t n, size_t* count) {
+  PcapBatch batch;
+  *count = 0;
+
+  if (!this->ready()) {
+    this->set_error("pcap is not ready");
+    return ERROR;
+  }
+
+  int rc = pcap_read_batch(this->pd_, pkts, n, &batch);
+  *count = batch.count;
+
+  if (batch.alloc_error) {
+    *count = 0;
+    this->set_error("memory allocation error");
+    return ERROR;
+  } else if (rc > 0) {
+    return OK;
+  } else if (rc == -1) {
+    this->set_error(pcap_geterr(this->pd_));
+    this->set_ready(false);
+    return ERROR;
+  } else {
+    // No more packets in the file.
+    this->set_ready(false);
+    return EXIT;
+  }
+}
+
+bool PcapFile::set_filter(const std::string& expr) {
+  std::string err;
+  if (!pcap_install_filter(this->pd_, expr, &err)) {
+    this->set_error(err);
+    return false;
+  }
+  return true;
+}
+
+
+static const uint32_t PCAP_MAGIC_USEC = 0xa1b2c3d4;
+static const uint32_t PCAP_MAGIC_NSEC = 0xa1b23c4d;
+static const uint32_t PCAP_HDR_LEN = 24;
+static const uint32_t PCAP_REC_HDR_LEN = 16;
+// Same as MAXIMUM_SNAPLEN of libpcap. Records longer than both of this and
+// snaplen in file header are regarded as corrupted.
+static const uint32_t PCAP_MAX_SNAPLEN = 262144;
+
+static const uint32_t PCAPNG_SHB = 0x0a0d0d0a;
+static const uint32_t PCAPNG_IDB = 0x00000001;
+static const uint32_t PCAPNG_SPB = 0x00000003;
+static const uint32_t PCAPNG_EPB = 0x00000006;
+static const uint32_t PCAPNG_BYTE_ORDER_MAGIC = 0x1a2b3c4d;
+static const uint16_t PCAPNG_OPT_IF_TSRESOL = 9;
+
+PcapMmapFile::PcapMmapFile(const std::string& file_path) :
+    file_path_(file_path), map_(nullptr), map_len_(0), offset_(0), end_(0),
+    done_(OK), format_(PCAP), swap_(false), ts_div_(1000000) {
+  if (this->setup()) {
+    this->set_ready(true);
+  }
+}
+
+PcapMmapFile::~PcapMmapFile() {
+}
+
+bool PcapMmapFile::setup() {
+  int fd = ::open(this->file_path_.c_str(), O_RDONLY);
+  if (fd < 0) {
+    this->set_error(this->file_path_ + ": " + strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size < static_cast<off_t>(PCAP_HDR_LEN)) {
+    ::close(fd);
+    this->set_error("unknown file format");
+    return false;
+  }
+
+  void* ptr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (ptr == MAP_FAILED) {
+    this->set_error(this->file_path_ + ": mmap: " + strerror(errno));
+    return false;
+  }
+
+  this->map_ = static_cast<const byte_t*>(ptr);
+  this->map_len_ = static_cast<size_t>(st.st_size);
+  this->end_ = this->map_len_;
+
+  size_t len = this->map_len_;
+  this->mapping_.reset(this->map_, [len](const byte_t* p) {
+      ::munmap(const_cast<byte_t*>(p), len);
+    });
+
+  // The file is read from head to tail only once. Hints are best effort and
+  // failure of them does not matter.
+  ::madvise(ptr, this->map_len_, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  ::madvise(ptr, this->map_len_, MADV_HUGEPAGE);
+#endif
+
+  uint32_t magic;
+  ::memcpy(&magic, this->map_, sizeof(magic));
+
+  if (magic == PCAPNG_SHB) {
+    this->format_ = PCAPNG;
+    // Section Header Block is parsed in read_pcapng().
+    return true;
+  }
+
+  if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC) {
+    this->swap_ = false;
+  } else if (__builtin_bswap32(magic) == PCAP_MAGIC_USEC ||
+             __builtin_bswap32(magic) == PCAP_MAGIC_NSEC) {
+    this->swap_ = true;
+    magic = __builtin_bswap32(magic);
+  } else {
+    this->set_error("unknown file format");
+    return false;
+  }
+
+  this->format_ = PCAP;
+  this->ts_div_ = (magic == PCAP_MAGIC_NSEC) ? 1000000000 : 1000000;
+  this->offset_ = PCAP_HDR_LEN;
+  return true;
+}
+
+uint16_t PcapMmapFile::get16(const byte_t* p) const {
+  uint16_t v;
+  ::memcpy(&v, p, sizeof(v));
+  return this->swap_ ? __builtin_bswap16(v) : v;
+}
+
+uint32_t PcapMmapFile::get32(const byte_t* p) const {
+  uint32_t v;
+  ::memcpy(&v, p, sizeof(v));
+  return this->swap_ ? __builtin_bswap32(v) : v;
+}
+
+Capture::Result PcapMmapFile::fail(const std::string& msg) {
+  this->set_error(msg);
+  this->done_ = ERROR;
+  return ERROR;
+}
+
+std::vector<PcapMmapFile*> PcapMmapFile::split(size_t n) {
+  std::vector<PcapMmapFile*> readers;
+  if (!this->ready() || n < 2) {
+    return readers;
+  }
+
+  // Walk record headers to find boundaries because pcap format has no marker
+  // to synchronize with a record from middle of the file. Section and
+  // interface state at a boundary is copied to a new reader.
+  const size_t begin = this->offset_;
+  const size_t range = (this->end_ - begin) / n;
+  size_t next = begin + range;
+  PcapMmapFile* curr = this;
+  PcapMmapFile walker(*this);
+
+  for (;;) {
+    const size_t offset = walker.offset_;
+    if (offset >= next && offset < walker.end_ && readers.size() + 1 < n) {
+      auto reader = new PcapMmapFile(walker);
+      reader->offset_ = offset;
+      reader->set_queue(readers.size() + 1);
+      curr->end_ = offset;
+      curr = reader;
+      readers.push_back(reader);
+      next += range;
+    }
+
+    if (walker.read(nullptr) != OK) {
+      break;
+    }
+  }
+
+  if (!walker.error().empty()) {
+    // Keep single reader and report error in read().
+    for (auto r : readers) {
+      delete r;
+    }
+    readers.clear();
+    this->end_ = walker.end_;
+  }
+
+  return readers;
+}
+
+Capture::Result PcapMmapFile::read(Packet* pkt) {
+  if (!this->ready()) {
+    this->set_error("pcap is not ready");
+    return ERROR;
+  }
+
+  if (this->done_ != OK) {
+    return this->done_;
+  }
+
+  Result rc;
+  do {
+    if (this->format_ == PCAP) {
+      rc = this->read_pcap(pkt);
+    } else {
+      rc = this->read_pcapng(pkt);
+    }
+  } while (rc == OK && pkt != nullptr && this->filtered(pkt));
+
+  return rc;
+}
+
+Capture::Result PcapMmapFile::read_batch(Packet** pkts, size_t n,
+                                         size_t* count) {
+  Result rc = NONE;
+  size_t i = 0;
+
+  // Call read() without virtual dispatch for each packet.
+  while (i < n && OK == (rc = this->PcapMmapFile::read(pkts[i]))) {
+    i++;
+  }
+
+  *count = i;
+  return (i > 0) ? OK : rc;
+}
+
+Capture::Result PcapMmapFile::read_pcap(Packet* pkt) {
+  if (this->offset_ == this->end_) {
+    // exit normaly.
+    this->done_ = EXIT;
+    return EXIT;
+  }
+
+  if (this->end_ - this->offset_ < PCAP_REC_HDR_LEN) {
+    return this->fail("truncated dump file");
+  }
+
+  const byte_t* hdr = this->map_ + this->offset_;
+  uint32_t caplen = this->get32(hdr + 8);
+  if (this->end_ - this->offset_ - PCAP_REC_HDR_LEN < caplen) {
+    return this->fail("truncated dump file");
+  }
+
+  struct timeval tv;
+  tv.tv_sec  = this->get32(hdr);
+  tv.tv_usec = this->get32(hdr + 4);
+  if (this->ts_div_ != 1000000) {
+    tv.tv_usec /= 1000;
+  }
+
+  if (pkt) {
+    pkt->lend(hdr + PCAP_REC_HDR_LEN, caplen, nullptr);
+    pkt->set_cap_len(caplen);
+    pkt->set_tv(tv);
+  }
+
+  this->offset_ += PCAP_REC_HDR_LEN + caplen;
+  return OK;
+}
+
+bool PcapMmapFile::parse_shb(const byte_t* blk) {
+  // Byte order of the section is decided by the byte order magic.
+  uint32_t bom;
+  ::memcpy(&bom, blk + 8, sizeof(bom));
+  if (bom == PCAPNG_BYTE_ORDER_MAGIC) {
+    this->swap_ = false;
+  } else if (__builtin_bswap32(bom) == PCAPNG_BYTE_ORDER_MAGIC) {
+    this->swap_ = true;
+  } else {
+    return false;
+  }
+
+  // Interface IDs are local to a section.
+  this->ifaces_.clear();
+  return true;
+}
+
+bool PcapMmapFile::parse_idb(const byte_t* blk, uint32_t blk_len) {
+  Interface iface;
+  iface.ts_div = 1000000;
+
+  // Options start after block type, length, link type, reserved and snaplen.
+  uint32_t opt = 16;
+  while (opt + 4 <= blk_len - 4) {
+    uint16_t code = this->get16(blk + opt);
+    uint16_t len  = this->get16(blk + opt + 2);
+    if (code == 0 || opt + 4 + len > blk_len - 4) {
+      break;  // opt_endofopt or broken option.
+    }
+
+    if (code == PCAPNG_OPT_IF_TSRESOL && len >= 1) {
+      byte_t v = blk[opt + 4];
+      byte_t exp = v & 0x7f;
+      if ((v & 0x80) ? (exp > 63) : (exp > 19)) {
+        return false;
+      }
+
+      iface.ts_div = 1;
+      for (byte_t i = 0; i < exp; i++) {
+        iface.ts_div *= (v & 0x80) ? 2 : 10;
+      }
+    }
+
+    opt += 4 + ((len + 3) & ~3u);
+  }
+
+  this->ifaces_.push_back(iface);
+  return true;
+}
+
+Capture::Result PcapMmapFile::read_pcapng(Packet* pkt) {
+  for (;;) {
+    if (this->offset_ == this->end_) {
+      // exit normaly.
+      this->done_ = EXIT;
+      return EXIT;
+    }
+
+    if (this->end_ - this->offset_ < 12) {
+      return this->fail("truncated dump file");
+    }
+
+    const byte_t* blk = this->map_ + this->offset_;
+    uint32_t blk_type;
+    ::memcpy(&blk_type, blk, sizeof(blk_type));
+
+    if (blk_type == PCAPNG_SHB && !this->parse_shb(blk)) {
+      return this->fail("unknown file format");
+    }
+
+    blk_type = this->get32(blk);
+    uint32_t blk_len = this->get32(blk + 4);
+    if (blk_len < 12 || blk_len % 4 != 0) {
+      return this->fail("invalid block length");
+    }
+    if (this->end_ - this->offset_ < blk_len) {
+      return this->fail("truncated dump file");
+    }
+
+    this->offset_ += blk_len;
+
+    switch (blk_type) {
+      case PCAPNG_IDB:
+        if (blk_len < 20 || !this->parse_idb(blk, blk_len)) {
+          return this->fail("invalid interface description block");
+        }
+        break;
+
+      case PCAPNG_EPB: {
+        if (blk_len < 32) {
+          return this->fail("truncated dump file");
+        }
+
+        uint32_t if_id  = this->get32(blk + 8);
+        uint64_t ts     = (static_cast<uint64_t>(this->get32(blk + 12)) << 32) |
+                          this->get32(blk + 16);
+        uint32_t caplen = this->get32(blk + 20);
+        if (if_id >= this->ifaces_.size()) {
+          return this->fail("unknown interface id");
+        }
+        if (caplen > blk_len - 32) {
+          return this->fail("truncated dump file");
+        }
+
+        uint64_t div = this->ifaces_[if_id].ts_div;
+        struct timeval tv;
+        tv.tv_sec  = ts / div;
+        tv.tv_usec = (ts % div) * 1000000 / div;
+
+        if (pkt) {
+          pkt->lend(blk + 28, caplen, nullptr);
+          pkt->set_cap_len(caplen);
+          pkt->set_tv(tv);
+        }
+        return OK;
+      }
+
+      case PCAPNG_SPB: {
+        if (blk_len < 16) {
+          return this->fail("truncated dump file");
+        }
+
+        // Simple Packet Block does not have captured length and timestamp.
+        uint32_t caplen = this->get32(blk + 8);
+        if (caplen > blk_len - 16) {
+          caplen = blk_len - 16;
+        }
+
+        if (pkt) {
+          struct timeval tv = {0, 0};
+          pkt->lend(blk + 12, caplen, nullptr);
+          pkt->set_cap_len(caplen);
+          pkt->set_tv(tv);
+        }
+        return OK;
+      }
+
+      default:
+        // Skip other blocks such as statistics and name resolution.
+        break;
+    }
+  }
+}
+
+
+// --------------------------------------------------------
+// Decompressor: streaming decompression of a compressed file
+
+enum Compression {
+  COMP_NONE,
+  COMP_GZIP,
+  COMP_ZSTD,
+  COMP_LZ4,
+};
+
+static Compression detect_compression(const byte_t* magic, size_t len) {
+  if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    return COMP_GZIP;
+  }
+  if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+      magic[2] == 0x2f && magic[3] == 0xfd) {
+    return COMP_ZSTD;
+  }
+  if (len >= 4 && magic[0] == 0x04 && magic[1] == 0x22 &&
+      magic[2] == 0x4d && magic[3] == 0x18) {
+    return COMP_LZ4;
+  }
+  return COMP_NONE;
+}
+
+class Decompressor {
+ public:
+  virtual ~Decompressor() {}
+  // Decompress up to len bytes into buf. Return number of bytes, 0 at end of
+  // stream or -1 with error message.
+  virtual ssize_t read(byte_t* buf, size_t len, std::string* err) = 0;
+  static Decompressor* open(const std::string& path, std::string* err);
+};
+
+#ifdef PACKETMACHINE_ZLIB
+
+class GzipDecompressor : public Decompressor {
+ private:
+  gzFile gz_;
+
+ public:
+  explicit GzipDecompressor(gzFile gz) : gz_(gz) {}
+  ~GzipDecompressor() { gzclose(this->gz_); }
+
+  ssize_t read(byte_t* buf, size_t len, std::string* err) {
+    int n = gzread(this->gz_, buf, static_cast<unsigned>(len));
+    if (n < 0) {
+      int errnum;
+      *err = gzerror(this->gz_, &errnum);
+      return -1;
+    }
+    return n;
+  }
+};
+
+#endif   // PACKETMACHINE_ZLIB
+
+#ifdef PACKETMACHINE_ZSTD
+
+class ZstdDecompressor : public Decompressor {
+ private:
+  FILE* fp_;
+  ZSTD_DCtx* ctx_;
+  std::vector<byte_t> in_buf_;
+  ZSTD_inBuffer in_;
+  size_t hint_;   // 0 if the last frame has been completed.
+  bool eof_;
+
+ public:
+  explicit ZstdDecompressor(FILE* fp) :
+      fp_(fp), ctx_(ZSTD_createDCtx()), in_buf_(ZSTD_DStreamInSize()),
+      hint_(0), eof_(false) {
+    this->in_.src = this->in_buf_.data();
+    this->in_.size = 0;
+    this->in_.pos = 0;
+  }
+  ~ZstdDecompressor() {
+    ZSTD_freeDCtx(this->ctx_);
+    ::fclose(this->fp_);
+  }
+
+  ssize_t read(byte_t* buf, size_t len, std::string* err) {
+    ZSTD_outBuffer out = {buf, len, 0};
+
+    while (out.pos < out.size) {
+      if (this->in_.pos == this->in_.size && !this->eof_) {
+        size_t n = ::fread(this->in_buf_.data(), 1, this->in_buf_.size(),
+                           this->fp_);
+        if (n == 0) {
+          if (::ferror(this->fp_)) {
+            *err = strerror(errno);
+            return -1;
+          }
+          this->eof_ = true;
+        }
+        this->in_.size = n;
+        this->in_.pos = 0;
+      }
+
+      // Call with empty input at end of file to flush buffered output.
+      size_t prev = out.pos;
+      size_t r = ZSTD_decompressStream(this->ctx_, &out, &this->in_);
+      if (ZSTD_isError(r)) {
+        *err = ZSTD_getErrorName(r);
+        return -1;
+      }
+
+      if (this->eof_ && out.pos == prev) {
+        break;
+      }
+      this->hint_ = r;
+    }
+
+    if (out.pos == 0 && this->hint_ != 0) {
+      *err = "truncated zstd stream";
+      return -1;
+    }
+    return out.pos;
+  }
+};
+
+#endif   // PACKETMACHINE_ZSTD
+
+#ifdef PACKETMACHINE_LZ4
+
+class Lz4Decompressor : public Decompressor {
+ private:
+  FILE* fp_;
+  LZ4F_dctx* ctx_;
+  std::vector<byte_t> in_buf_;
+  size_t in_pos_, in_len_;
+  size_t hint_;   // 0 if the last frame has been completed.
+  bool eof_;
+
+ public:
+  Lz4Decompressor(FILE* fp, LZ4F_dctx* ctx) :
+      fp_(fp), ctx_(ctx), in_buf_(1 << 20), in_pos_(0), in_len_(0),
+      hint_(0), eof_(false) {
+  }
+  ~Lz4Decompressor() {
+    LZ4F_freeDecompressionContext(this->ctx_);
+    ::fclose(this->fp_);
+  }
+
+  ssize_t read(byte_t* buf, size_t len, std::string* err) {
+    size_t done = 0;
+
+    while (done < len) {
+      if (this->in_pos_ == this->in_len_ && !this->eof_) {
+        size_t n = ::fread(this->in_buf_.data(), 1, this->in_buf_.size(),
+                           this->fp_);
+        if (n == 0) {
+          if (::ferror(this->fp_)) {
+            *err = strerror(errno);
+            return -1;
+          }
+          this->eof_ = true;
+        }
+        this->in_len_ = n;
+        this->in_pos_ = 0;
+      }
+
+      size_t dst_len = len - done;
+      size_t src_len = this->in_len_ - this->in_pos_;
+      size_t r = LZ4F_decompress(this->ctx_, buf + done, &dst_len,
+                                 this->in_buf_.data() + this->in_pos_,
+                                 &src_len, nullptr);
+      if (LZ4F_isError(r)) {
+        *err = LZ4F_getErrorName(r);
+        return -1;
+      }
+      this->in_pos_ += src_len;
+      done += dst_len;
+
+      if (this->eof_ && dst_len == 0) {
+        break;
+      }
+      this->hint_ = r;
+    }
+
+    if (done == 0 && this->hint_ != 0) {
+      *err = "truncated lz4 stream";
+      return -1;
+    }
+    return done;
+  }
+};
+
+#endif   // PACKETMACHINE_LZ4
+
+Decompressor* Decompressor::open(const std::string& path, std::string* err) {
+  FILE* fp = ::fopen(path.c_str(), "rb");
+  if (fp == nullptr) {
+    *err = path + ": " + strerror(errno);
+    return nullptr;
+  }
+
+  byte_t magic[4];
+  size_t len = ::fread(magic, 1, sizeof(magic), fp);
+  ::rewind(fp);
+
+  switch (detect_compression(magic, len)) {
+    case COMP_GZIP:
+#ifdef PACKETMACHINE_ZLIB
+    {
+      ::fclose(fp);
+      gzFile gz = gzopen(path.c_str(), "rb");
+      if (gz == nullptr) {
+        *err = path + ": " + strerror(errno);
+        return nullptr;
+      }
+      gzbuffer(gz, 1 << 20);
+      return new GzipDecompressor(gz);
+    }
+#else
+      *err = "gzip is not supported in this build";
+      break;
+#endif
+
+    case COMP_ZSTD:
+#ifdef PACKETMACHINE_ZSTD
+      return new ZstdDecompressor(fp);
+#else
+      *err = "zstd is not supported in this build";
+      break;
+#endif
+
+    case COMP_LZ4:
+#ifdef PACKETMACHINE_LZ4
+    {
+      LZ4F_dctx* ctx;
+      if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION))) {
+        *err = "fail to create lz4 decompression context";
+        break;
+      }
+      return new Lz4Decompressor(fp, ctx);
+    }
+#else
+      *err = "lz4 is not supported in this build";
+      break;
+#endif
+
+    case COMP_NONE:
+      *err = "unknown file format";
+      break;
+  }
+
+  ::fclose(fp);
+  return nullptr;
+}
+
+
+// --------------------------------------------------------
+// PcapStreamFile
+
+static const size_t STREAM_CHUNK_SIZE = 4 * 1024 * 1024;
+static const size_t STREAM_CHUNK_COUNT = 8;
+
+PcapStreamFile::PcapStreamFile(const std::string& file_path,
+                               const Config& config) :
+    file_path_(file_path), dcmp_(nullptr), chunks_(nullptr),
+    chunk_size_(STREAM_CHUNK_SIZE), chunk_count_(STREAM_CHUNK_COUNT),
+    running_(false), chunk_idx_(0), chunk_(nullptr), pos_(0),
+    has_hdr_(false), swap_(false), nsec_(false),
+    snaplen_(0), caplen_(0), done_(OK) {
+  if (this->setup(config)) {
+    this->set_ready(true);
+  }
+}
+
+PcapStreamFile::~PcapStreamFile() {
+  if (this->running_) {
+    this->running_ = false;
+    this->Thread::join();
+  }
+
+  if (this->chunks_) {
+    for (size_t i = 0; i < this->chunk_count_; i++) {
+      delete [] this->chunks_[i].buf;
+    }
+    delete [] this->chunks_;
+  }
+  delete this->dcmp_;
+}
+
+bool PcapStreamFile::setup(const Config& config) {
+  for (const auto& conf : config.map()) {
+    if (conf.first != "chunk_size" && conf.first != "chunk_count") {
+      this->set_error("'" + conf.first + "' is not valid config key");
+      return false;
+    }
+  }
+
+  if (config.has("chunk_size")) {
+    const int chunk_size = config.get("chunk_size").as_int();
+    if (chunk_size <= 0) {
+      this->set_error("chunk_size must be positive");
+      return false;
+    }
+    this->chunk_size_ = static_cast<size_t>(chunk_size);
+  }
+  if (config.has("chunk_count")) {
+    const int chunk_count = config.get("chunk_count").as_int();
+    if (chunk_count < 2) {
+      this->set_error("chunk_count must be 2 or more");
+      return false;
+    }
+    this->chunk_count_ = static_cast<size_t>(chunk_count);
+  }
+
+  std::string err;
+  this->dcmp_ = Decompressor::open(this->file_path_, &err);
+  if (this->dcmp_ == nullptr) {
+    this->set_error(err);
+    return false;
+  }
+
+  this->chunks_ = new Chunk[this->chunk_count_];
+  for (size_t i = 0; i < this->chunk_count_; i++) {
+    this->chunks_[i].buf = new byte_t[this->chunk_size_];
+    this->chunks_[i].len = 0;
+    this->chunks_[i].eof = false;
+    this->chunks_[i].state = FREE;
+    this->chunks_[i].refs = 0;
+  }
+
+  this->running_ = true;
+  this->Thread::start();
+
+  // Read file header here to report format error before starting Machine.
+  Result rc;
+  const byte_t* hdr;
+  bool lent;
+  while (NONE == (rc = this->fetch(PCAP_HDR_LEN, &hdr, &lent))) {
+    usleep(1);
+  }
+  if (rc == EXIT) {
+    this->set_error("unknown file format");
+    return false;
+  } else if (rc != OK) {
+    return false;
+  }
+
+  uint32_t magic;
+  ::memcpy(&magic, hdr, sizeof(magic));
+  if (__builtin_bswap32(magic) == PCAP_MAGIC_USEC ||
+      __builtin_bswap32(magic) == PCAP_MAGIC_NSEC) {
+    this->swap_ = true;
+    magic = __builtin_bswap32(magic);
+  }
+  if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC) {
+    // pcapng in compressed file is not supported.
+    this->set_error("unknown file format");
+    return false;
+  }
+
+  this->nsec_ = (magic == PCAP_MAGIC_NSEC);
+
+  uint32_t snaplen;
+  ::memcpy(&snaplen, hdr + 16, sizeof(snaplen));
+  this->snaplen_ = this->swap_ ? __builtin_bswap32(snaplen) : snaplen;
+  this->carry_.clear();
+  return true;
+}
+
+bool PcapStreamFile::is_compressed(const std::string& file_path) {
+  FILE* fp = ::fopen(file_path.c_str(), "rb");
+  if (fp == nullptr) {
+    return false;
+  }
+
+  byte_t magic[4];
+  size_t len = ::fread(magic, 1, sizeof(magic), fp);
+  ::fclose(fp);
+  return detect_compression(magic, len) != COMP_NONE;
+}
+
+void PcapStreamFile::thread_main() {
+  size_t idx = 0;
+
+  while (this->running_) {
+    Chunk& chunk = this->chunks_[idx];
+    if (chunk.state.load(std::memory_order_acquire) != FREE) {
+      // Reader or packets still use the chunk.
+      usleep(10);
+      continue;
+    }
+
+    size_t len = 0;
+    bool eof = false;
+    while (len < this->chunk_size_) {
+      ssize_t n = this->dcmp_->read(chunk.buf + len, this->chunk_size_ - len,
+                                    &this->dcmp_error_);
+      if (n <= 0) {
+        eof = true;
+        break;
+      }
+      len += n;
+    }
+
+    chunk.len = len;
+    chunk.eof = eof;
+    chunk.state.store(READY, std::memory_order_release);
+
+    if (eof) {
+      break;
+    }
+    idx = (idx + 1) % this->chunk_count_;
+  }
+}
+
+void PcapStreamFile::unref_chunk(size_t idx) {
+  Chunk& chunk = this->chunks_[idx];
+  uint32_t r = chunk.refs.load(std::memory_order_acquire);
+
+  for (;;) {
+    assert(r > 0);
+    if (r == 1) {
+      // The last reference. Hand the chunk over to decompression thread.
+      chunk.refs.store(0, std::memory_order_relaxed);
+      chunk.state.store(FREE, std::memory_order_release);
+      return;
+    }
+
+    if (chunk.refs.compare_exchange_weak(r, r - 1,
+                                         std::memory_order_acq_rel)) {
+      return;
+    }
+  }
+}
+
+void PcapStreamFile::give_back(const Packet* pkt) {
+  this->unref_chunk(static_cast<size_t>(pkt->tag()));
+}
+
+Capture::Result PcapStreamFile::fail(const std::string& msg) {
+  this->set_error(msg);
+  this->done_ = ERROR;
+  return ERROR;
+}
+
+// Get len bytes of decompressed data. *ptr points the data in current chunk
+// (*lent is true) or carry_ when the data crosses chunk boundary. NONE is
+// returned if the next chunk has not been decompressed yet, then call again
+// with same len. EXIT is returned at end of file with no data left.
+Capture::Result PcapStreamFile::fetch(size_t len, const byte_t** ptr,
+                                      bool* lent) {
+  for (;;) {
+    if (this->chunk_ == nullptr) {
+      Chunk* chunk = &this->chunks_[this->chunk_idx_];
+      if (chunk->state.load(std::memory_order_acquire) != READY) {
+        // Not decompressed yet, or packets of previous round are still used.
+        return NONE;
+      }
+      // Reader holds own reference while walking the chunk.
+      chunk->refs.store(1, std::memory_order_relaxed);
+      chunk->state.store(USED, std::memory_order_relaxed);
+      this->chunk_ = chunk;
+      this->pos_ = 0;
+    }
+
+    const Chunk* chunk = this->chunk_;
+    const size_t left = chunk->len - this->pos_;
+
+    if (this->carry_.empty() && left >= len) {
+      *ptr = chunk->buf + this->pos_;
+      *lent = true;
+      this->pos_ += len;
+      return OK;
+    }
+
+    const byte_t* src = chunk->buf + this->pos_;
+    const size_t need = len - this->carry_.size();
+    if (left >= need) {
+      this->carry_.insert(this->carry_.end(), src, src + need);
+      this->pos_ += need;
+      *ptr = this->carry_.data();
+      *lent = false;
+      return OK;
+    }
+
+    this->carry_.insert(this->carry_.end(), src, src + left);
+    this->pos_ += left;
+
+    if (chunk->eof) {
+      if (!this->dcmp_error_.empty()) {
+        return this->fail(this->dcmp_error_);
+      }
+      if (!this->carry_.empty()) {
+        return this->fail("truncated dump file");
+      }
+      this->done_ = EXIT;
+      return EXIT;
+    }
+
+    this->unref_chunk(this->chunk_idx_);
+    this->chunk_idx_ = (this->chunk_idx_ + 1) % this->chunk_count_;
+    this->chunk_ = nullptr;
+  }
+}
+
+Capture::Result PcapStreamFile::read(Packet* pkt) {
+  if (!this->ready()) {
+    this->set_error("pcap is not ready");
+    return ERROR;
+  }
+
+  Result rc;
+  while (OK == (rc = this->read_record(pkt)) && this->filtered(pkt)) {
+    pkt->release();
+  }
+  return rc;
+}
+
+Capture::Result PcapStreamFile::read_record(Packet* pkt) {
+  if (this->done_ != OK) {
+    return this->done_;
+  }
+
+  Result rc;
+  const byte_t* ptr;
+  bool lent;
+
+  if (!this->has_hdr_) {
+    if (OK != (rc = this->fetch(PCAP_REC_HDR_LEN, &ptr, &lent))) {
+      return rc;
+    }
+
+    uint32_t v[3];
+    ::memcpy(v, ptr, sizeof(v));
+    for (auto& e : v) {
+      e = this->swap_ ? __builtin_bswap32(e) : e;
+    }
+    this->tv_.tv_sec  = v[0];
+    this->tv_.tv_usec = this->nsec_ ? v[1] / 1000 : v[1];
+    this->caplen_ = v[2];
+    this->carry_.clear();
+    this->has_hdr_ = true;
+
+    // Corrupted length would make fetch() grow carry_ without bound.
+    const uint32_t max_len = (this->snaplen_ > PCAP_MAX_SNAPLEN) ?
+                             this->snaplen_ : PCAP_MAX_SNAPLEN;
+    if (this->caplen_ > max_len) {
+      return this->fail("invalid record length");
+    }
+  }
+
+  if (OK != (rc = this->fetch(this->caplen_, &ptr, &lent))) {
+    return (rc == EXIT) ? this->fail("truncated dump file") : rc;
+  }
+
+  if (lent) {
+    this->chunk_->refs.fetch_add(1, std::memory_order_relaxed);
+    pkt->lend(ptr, this->caplen_, this, this->chunk_idx_);
+  } else if (pkt->store(ptr, this->caplen_) == false) {
+    return this->fail("fail to store packet data");
+  }
+  pkt->set_cap_len(this->caplen_);
+  pkt->set_tv(this->tv_);
+
+  this->carry_.clear();
+  this->has_hdr_ = false;
+  return OK;
+}
+
+Capture::Result PcapStreamFile::read_batch(Packet** pkts, size_t n,
+                                           size_t* count) {
+  Result rc = NONE;
+  size_t i = 0;
+
+  while (i < n && OK == (rc = this->PcapStreamFile::read(pkts[i]))) {
+    i++;
+  }
+
+  *count = i;
+  return (i > 0) ? OK : rc;
+}
+
+
+#ifdef __linux__
+
+AfPacket::AfPacket(const std::string& dev_name, const Config& config,
+                   uint16_t fanout_group, size_t queue) :
+    dev_name_(dev_name), sock_(-1), ring_(nullptr), ring_len_(0),
+    block_size_(0), block_count_(0), zero_copy_(true), fanout_(1),
+    fanout_group_(fanout_group), refs_(nullptr),
+    block_idx_(0), block_(nullptr), frame_(nullptr), frame_left_(0) {
+  this->set_queue(queue);
+  if (this->setup(config)) {
+    this->set_ready(true);
+  }
+}
+
+AfPacket::~AfPacket() {
+  if (this->ring_) {
+    ::munmap(this->ring_, this->ring_len_);
+  }
+  if (this->sock_ >= 0) {
+    ::close(this->sock_);
+  }
+  delete[] this->refs_;
+}
+
+bool AfPacket::setup(const Config& config) {
+  static const char* keys[] = {
+    "block_size", "block_count", "frame_size", "block_timeout", "zero_copy",
+    "fanout",
+  };
+
+  for (const auto& conf : config.map()) {
+    bool found = false;
+    for (auto k : keys) {
+      found |= (conf.first == k);
+    }
+    if (!found) {
+      this->set_error("'" + conf.first + "' is not valid config key");
+      return false;
+    }
+  }
+
+  auto get_int = [&](const std::string& key, int dflt) {
+    return config.has(key) ? config.get(key).as_int() : dflt;
+  };
+  const int block_size    = get_int("block_size", 1 << 22);
+  const int block_count   = get_int("block_count", 64);
+  const int frame_size    = get_int("frame_size", 1 << 11);
+  const int block_timeout = get_int("block_timeout", 10);
+  const int fanout        = get_int("fanout", 1);
+
+  const int page_size = ::getpagesize();
+  if (block_size < page_size || (block_size & (block_size - 1)) != 0) {
+    this->set_error("block_size must be power of 2 and >= page size");
+    return false;
+  }
+  if (block_count <= 0) {
+    this->set_error("block_count must be positive");
+    return false;
+  }
+  if (frame_size < TPACKET_ALIGNMENT || frame_size > block_size ||
+      (frame_size % TPACKET_ALIGNMENT) != 0) {
+    this->set_error("frame_size must be multiple of 16 and <= block_size");
+    return false;
+  }
+  if (fanout <= 0 || fanout > 0xffff) {
+    this->set_error("fanout must be between 1 and 65535");
+    return false;
+  }
+
+  this->block_size_  = static_cast<uint32_t>(block_size);
+  this->block_count_ = static_cast<uint32_t>(block_count);
+  this->fanout_      = fanout;
+  this->zero_copy_   = config.has("zero_copy") ?
+                       config.get("zero_copy").as_bool() : true;
+  this->refs_ = new std::atomic<uint32_t>[this->block_count_];
+  for (uint32_t i = 0; i < this->block_count_; i++) {
+    this->refs_[i] = 0;
+  }
+
+  auto sys_error = [&](const std::string& func) {
+    this->set_error(this->dev_name_ + ": " + func + ": " + ::strerror(errno));
+    return false;
+  };
+
+  const unsigned int ifindex = ::if_nametoindex(this->dev_name_.c_str());
+  if (ifindex == 0) {
+    return sys_error("if_nametoindex");
+  }
+
+  this->sock_ = ::socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  if (this->sock_ < 0) {
+    return sys_error("socket");
+  }
+
+  int version = TPACKET_V3;
+  if (::setsockopt(this->sock_, SOL_PACKET, PACKET_VERSION,
+                   &version, sizeof(version)) != 0) {
+    return sys_error("PACKET_VERSION");
+  }
+
+  struct tpacket_req3 req;
+  ::memset(&req, 0, sizeof(req));
+  req.tp_block_size = this->block_size_;
+  req.tp_block_nr   = this->block_count_;
+  req.tp_frame_size = static_cast<unsigned int>(frame_size);
+  req.tp_frame_nr   = (req.tp_block_size / req.tp_frame_size) *
+                      req.tp_block_nr;
+  req.tp_retire_blk_tov = static_cast<unsigned int>(block_timeout);
+  if (::setsockopt(this->sock_, SOL_PACKET, PACKET_RX_RING,
+                   &req, sizeof(req)) != 0) {
+    return sys_error("PACKET_RX_RING");
+  }
+
+  this->ring_len_ = static_cast<size_t>(req.tp_block_size) * req.tp_block_nr;
+  void* ring = ::mmap(nullptr, this->ring_len_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, this->sock_, 0);
+  if (ring == MAP_FAILED) {
+    return sys_error("mmap");
+  }
+  this->ring_ = static_cast<byte_t*>(ring);
+
+  struct sockaddr_ll sll;
+  ::memset(&sll, 0, sizeof(sll));
+  sll.sll_family   = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex  = static_cast<int>(ifindex);
+  if (::bind(this->sock_, reinterpret_cast<struct sockaddr*>(&sll),
+             sizeof(sll)) != 0) {
+    return sys_error("bind");
+  }
+
+  // Same as PcapDev, capture packets with promiscuous mode.
+  struct packet_mreq mreq;
+  ::memset(&mreq, 0, sizeof(mreq));
+  mreq.mr_ifindex = static_cast<int>(ifindex);
+  mreq.mr_type    = PACKET_MR_PROMISC;
+  if (::setsockopt(this->sock_, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                   &mreq, sizeof(mreq)) != 0) {
+    return sys_error("PACKET_ADD_MEMBERSHIP");
+  }
+
+  if (this->fanout_ > 1) {
+    // Distribute packets to sockets in the group by flow hash. The hash is
+    // same for both directions and fragments are defragmented before hashing,
+    // then all packets of a flow go to one socket.
+    int arg = this->fanout_group_ |
+              ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+    if (::setsockopt(this->sock_, SOL_PACKET, PACKET_FANOUT,
+                     &arg, sizeof(arg)) != 0) {
+      return sys_error("PACKET_FANOUT");
+    }
+  }
+
+  return true;
+}
+
+uint16_t AfPacket::new_fanout_group() {
+  // Group ID must be unique in the network namespace, not only in process.
+  static std::atomic<uint16_t> seq(0);
+  return static_cast<uint16_t>(::getpid() + seq.fetch_add(1));
+}
+
+void AfPacket::unref_block(uint32_t idx) {
+  std::atomic<uint32_t>& refs = this->refs_[idx];
+  uint32_t r = refs.load(std::memory_order_acquire);
+
+  for (;;) {
+    assert(r > 0);
+    if (r == 1) {
+      // The last reference. Give the block back to the kernel before marking
+      // the block as free so that the reader never opens a stale block.
+      byte_t* block = this->ring_ + static_cast<size_t>(idx) * this->block_size_;
+      auto desc = reinterpret_cast<struct tpacket_block_desc*>(block);
+      __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                       __ATOMIC_RELEASE);
+      refs.store(0, std::memory_order_release);
+      return;
+    }
+
+    if (refs.compare_exchange_weak(r, r - 1, std::memory_order_acq_rel)) {
+      return;
+    }
+  }
+}
+
+void AfPacket::give_back(const Packet* pkt) {
+  this->unref_block(static_cast<uint32_t>(pkt->tag()));
+}
+
+bool AfPacket::set_filter(const std::string& expr) {
+  // The kernel strips the outer VLAN tag before the socket filter runs, and
+  // "vlan" compiled for a dead handle never matches such frames. A live
+  // handle of the device makes libpcap generate code testing the tag in
+  // metadata (SKF_AD_VLAN_TAG_PRESENT) as well as in the frame.
+  std::string err;
+  std::shared_ptr<struct bpf_program> bpf;
+  char errbuf[PCAP_ERRBUF_SIZE];
+  pcap_t* pd = ::pcap_open_live(this->dev_name_.c_str(), 0xffff, 0, 0, errbuf);
+  if (pd) {
+    bpf = pcap_compile_filter(pd, expr, &err);
+    ::pcap_close(pd);
+  } else {
+    // Tags stripped by the kernel are not visible for the filter.
+    bpf = Capture::compile_filter(expr, &err);
+  }
+  if (!bpf) {
+    this->set_error(err);
+    return false;
+  }
+
+  // Attach to the socket so that the kernel drops packets before they are
+  // copied into the ring. Layout of bpf_insn is same as sock_filter.
+  struct sock_fprog fprog;
+  fprog.len = static_cast<uint16_t>(bpf->bf_len);
+  fprog.filter = reinterpret_cast<struct sock_filter*>(bpf->bf_insns);
+  if (::setsockopt(this->sock_, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+                   sizeof(fprog)) != 0) {
+    this->set_error(std::string("SO_ATTACH_FILTER: ") + strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+Capture::Result AfPacket::read(Packet* pkt) {
+  if (!this->ready()) {
+    this->set_error("AF_PACKET socket is not ready");
+    return ERROR;
+  }
+
+  if (this->block_ == nullptr) {
+    if (this->refs_[this->block_idx_].load(std::memory_order_acquire) > 0) {
+      // Packets in the block have not been released yet.
+      return NONE;
+    }
+
+    byte_t* block = this->ring_ +
+                    static_cast<size_t>(this->block_idx_) * this->block_size_;
+    auto desc = reinterpret_cast<struct tpacket_block_desc*>(block);
+    uint32_t status = __atomic_load_n(&desc->hdr.bh1.block_status,
+                                      __ATOMIC_ACQUIRE);
+    if ((status & TP_STATUS_USER) == 0) {
+      // The kernel still owns the block, no packet arrived.
+      return NONE;
+    }
+
+    // Reader has own reference until walking all frames in the block.
+    this->refs_[this->block_idx_].store(1, std::memory_order_relaxed);
+    this->block_ = block;
+    this->frame_ = block + desc->hdr.bh1.offset_to_first_pkt;
+    this->frame_left_ = desc->hdr.bh1.num_pkts;
+  }
+
+  if (this->frame_left_ == 0) {
+    this->unref_block(this->block_idx_);
+    this->block_idx_ = (this->block_idx_ + 1) % this->block_count_;
+    this->block_ = nullptr;
+    return NONE;
+  }
+
+  auto hdr = reinterpret_cast<const struct tpacket3_hdr*>(this->frame_);
+  const byte_t* frame = this->frame_ + hdr->tp_mac;
+  uint32_t cap_len = hdr->tp_snaplen;
+  if ((hdr->tp_status & TP_STATUS_VLAN_VALID) && cap_len >= 2 * ETH_ALEN) {
+    // The kernel strips 802.1Q tag before the frame gets to the ring. Put
+    // the tag back after MAC addresses as libpcap does, then the frame is
+    // copied instead of lent.
+    const uint16_t tpid = htons((hdr->tp_status & TP_STATUS_VLAN_TPID_VALID) ?
+                                hdr->hv1.tp_vlan_tpid : ETH_P_8021Q);
+    const uint16_t tci = htons(hdr->hv1.tp_vlan_tci);
+    this->vlan_frame_.resize(cap_len + VLAN_TAG_LEN);
+    byte_t* p = this->vlan_frame_.data();
+    ::memcpy(p, frame, 2 * ETH_ALEN);
+    ::memcpy(p + 2 * ETH_ALEN, &tpid, sizeof(tpid));
+    ::memcpy(p + 2 * ETH_ALEN + sizeof(tpid), &tci, sizeof(tci));
+    ::memcpy(p + 2 * ETH_ALEN + VLAN_TAG_LEN, frame + 2 * ETH_ALEN,
+             cap_len - 2 * ETH_ALEN);
+    cap_len += VLAN_TAG_LEN;
+    if (pkt->store(p, cap_len) == false) {
+      this->set_error("memory allocation error");
+      return ERROR;
+    }
+  } else if (this->zero_copy_) {
+    this->refs_[this->block_idx_].fetch_add(1, std::memory_order_relaxed);
+    pkt->lend(frame, cap_len, this, this->block_idx_);
+  } else if (pkt->store(frame, cap_len) == false) {
+    this->set_error("memory allocation error");
+    return ERROR;
+  }
+
+  struct timeval tv;
+  tv.tv_sec  = hdr->tp_sec;
+  tv.tv_usec = hdr->tp_nsec / 1000;
+  pkt->set_cap_len(cap_len);
+  pkt->set_tv(tv);
+
+  this->frame_left_--;
+  if (this->frame_left_ > 0) {
+    this->frame_ += hdr->tp_next_offset;
+  } else {
+    // Walked all frames, then release own reference of the block.
+    this->unref_block(this->block_idx_);
+    this->block_idx_ = (this->block_idx_ + 1) % this->block_count_;
+    this->block_ = nullptr;
+  }
+
+  return OK;
+}
+
+Capture::Result AfPacket::read_batch(Packet** pkts, size_t n, size_t* count) {
+  Result rc = NONE;
+  size_t i = 0;
+
+  // Walk frames in ring blocks without virtual dispatch for each packet.
+  while (i < n && OK == (rc = this->AfPacket::read(pkts[i]))) {
+    i++;
+  }
+
+  *count = i;
+  return (i > 0) ? OK : rc;
+}
+
+#endif   // __linux__
+
 }  // namespace pm
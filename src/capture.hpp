@@ -29,8 +29,14 @@
 
 #include <pcap.h>
 #include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
 
 #include "./packetmachine/common.hpp"
+#include "./packetmachine/config.hpp"
+#include "./packet.hpp"
+#include "./thread.hpp"
 
 namespace pm {
 
@@ -51,6 +57,10 @@ class Capture {
  private:
   std::string error_;
   bool ready_;
+  size_t queue_;
+  std::shared_ptr<struct bpf_program> bpf_;   // installed by set_filter().
+
+  bool match_filter(const Packet* pkt) const;
 
  protected:
   void set_error(const std::string& error) {
@@ -59,13 +69,43 @@ class Capture {
   void set_ready(bool ready) {
     this->ready_ = ready;
   }
+  void set_queue(size_t queue) {
+    this->queue_ = queue;
+  }
+  // Compile BPF expression for Ethernet frames. Return nullptr and set
+  // message to err on failure.
+  static std::shared_ptr<struct bpf_program>
+  compile_filter(const std::string& expr, std::string* err);
+  // Return true if pkt should be dropped by filter installed by default
+  // set_filter(). Data source reading records by itself calls it.
+  bool filtered(const Packet* pkt) const {
+    return (this->bpf_ && !this->match_filter(pkt));
+  }
 
  public:
   Capture();
   virtual ~Capture();
 
   virtual Result read(Packet *pkt) = 0;
+  // Read up to n packets into pkts and set number of read packets to count.
+  // OK is returned if one or more packets are read. Otherwise count is 0 and
+  // the result is same as read(). It does not wait for n packets, returns
+  // with packets that are available now.
+  virtual Result read_batch(Packet** pkts, size_t n, size_t* count);
   virtual const std::string& src_name() const = 0;
+  // Offline data source (e.g. file) can be merged with other offline sources
+  // in timestamp order.
+  virtual bool is_offline() const { return false; }
+  // Install BPF filter. Packets not matching the filter are dropped by data
+  // source and not passed to Kernel. Return false and set error() on failure.
+  virtual bool set_filter(const std::string& expr);
+  // Return file descriptor that becomes readable when packets arrive, or -1
+  // if the data source can not be waited on. Data source may switch itself
+  // to non-blocking mode, then read() returns NONE immediately.
+  virtual int selectable_fd() { return -1; }
+  // Index of queue when a data source is divided into multiple queues (e.g.
+  // PACKET_FANOUT). Packets of each queue are decoded by own Kernel.
+  size_t queue() const { return this->queue_; }
   bool ready() const { return this->ready_; }
   const std::string& error() const { return this->error_; }
 };
@@ -83,6 +123,9 @@ class PcapDev : public Capture {
   ~PcapDev();
 
   Result read(Packet *pkt);
+  Result read_batch(Packet** pkts, size_t n, size_t* count);
+  bool set_filter(const std::string& expr);
+  int selectable_fd();
   const std::string& src_name() const { return this->dev_name_; }
 };
 
@@ -97,9 +140,200 @@ class PcapFile : public Capture {
   ~PcapFile();
 
   Result read(Packet *pkt);
+  Result read_batch(Packet** pkts, size_t n, size_t* count);
+  bool set_filter(const std::string& expr);
+  const std::string& src_name() const { return this->file_path_; }
+  bool is_offline() const { return true; }
+};
+
+// PcapMmapFile maps a whole pcap or pcapng file into memory and walks record
+// headers by itself instead of pcap_next_ex(). Packet refers to data in the
+// mapping without copy. The mapping is kept until PcapMmapFile is deleted,
+// so there is nothing to give back per packet.
+//
+// split() divides the file into byte ranges starting on record boundaries so
+// that ranges can be read (and decoded) in parallel. Readers created by
+// split() share the mapping.
+
+class PcapMmapFile : public Capture {
+ private:
+  enum Format {
+    PCAP,
+    PCAPNG,
+  };
+
+  struct Interface {
+    uint64_t ts_div;  // number of timestamp units per second.
+  };
+
+  std::string file_path_;
+  std::shared_ptr<const byte_t> mapping_;
+  const byte_t* map_;
+  size_t map_len_;
+  size_t offset_;     // offset of next record.
+  size_t end_;        // end offset of range to be read.
+  Result done_;       // EXIT or ERROR once reached, then returned again.
+  Format format_;
+  bool swap_;         // byte order of the file differs from host.
+  uint64_t ts_div_;   // timestamp units per second of pcap format.
+  std::vector<Interface> ifaces_;   // interfaces of current pcapng section.
+
+  bool setup();
+  uint16_t get16(const byte_t* p) const;
+  uint32_t get32(const byte_t* p) const;
+  Result read_pcap(Packet* pkt);
+  Result read_pcapng(Packet* pkt);
+  bool parse_shb(const byte_t* blk);
+  bool parse_idb(const byte_t* blk, uint32_t blk_len);
+  Result fail(const std::string& msg);
+
+ public:
+  explicit PcapMmapFile(const std::string& file_path);
+  ~PcapMmapFile();
+
+  std::vector<PcapMmapFile*> split(size_t n);
+  Result read(Packet *pkt);
+  Result read_batch(Packet** pkts, size_t n, size_t* count);
+  const std::string& src_name() const { return this->file_path_; }
+  bool is_offline() const { return true; }
+};
+
+// PcapStreamFile reads a compressed pcap file (gzip, zstd or lz4 frame)
+// without writing decompressed data to disk. Own thread decompresses the file
+// into large chunks and read() walks records in the chunks, then
+// decompression, record walking (Input thread) and decoding (Kernel thread)
+// run as pipeline. Packet refers to data in a chunk without copy except for a
+// record crossing chunk boundary, and a chunk is reused for decompression
+// after all packets in the chunk are released. Only pcap format (not pcapng)
+// is supported in compressed file.
+//
+// Available configs:
+// - chunk_size:  Size of a chunk of decompressed data in byte
+// - chunk_count: Number of chunks
+
+class Decompressor;
+
+class PcapStreamFile : public Capture, public PacketLender, private Thread {
+ private:
+  enum ChunkState {
+    FREE,     // to be filled by decompression thread.
+    READY,    // filled, not opened by reader yet.
+    USED,     // opened by reader, until all references are released.
+  };
+
+  struct Chunk {
+    byte_t* buf;
+    size_t len;
+    bool eof;                      // last chunk of the file.
+    std::atomic<int> state;
+    std::atomic<uint32_t> refs;    // reference count while USED.
+  };
+
+  std::string file_path_;
+  Decompressor* dcmp_;
+  Chunk* chunks_;
+  size_t chunk_size_;
+  size_t chunk_count_;
+  std::atomic<bool> running_;
+  std::string dcmp_error_;       // set by decompression thread before eof.
+
+  // State of reader.
+  size_t chunk_idx_;
+  Chunk* chunk_;                 // chunk that is read now, or nullptr.
+  size_t pos_;
+  std::vector<byte_t> carry_;    // data crossing chunk boundary.
+  bool has_hdr_;                 // record header has been read.
+  bool swap_;
+  bool nsec_;
+  uint32_t snaplen_;             // in file header.
+  uint32_t caplen_;
+  struct timeval tv_;
+  Result done_;
+
+  bool setup(const Config& config);
+  void thread_main();
+  Result fetch(size_t len, const byte_t** ptr, bool* lent);
+  Result read_record(Packet* pkt);
+  void unref_chunk(size_t idx);
+  Result fail(const std::string& msg);
+
+ public:
+  explicit PcapStreamFile(const std::string& file_path,
+                          const Config& config = Config());
+  ~PcapStreamFile();
+
+  // Return true if the file is compressed by supported format.
+  static bool is_compressed(const std::string& file_path);
+
+  Result read(Packet *pkt);
+  Result read_batch(Packet** pkts, size_t n, size_t* count);
   const std::string& src_name() const { return this->file_path_; }
+  bool is_offline() const { return true; }
+  void give_back(const Packet* pkt);
 };
 
+#ifdef __linux__
+
+// AfPacket captures packets via AF_PACKET socket with TPACKET_V3 memory
+// mapped ring. Linux kernel fills a block with packets and AfPacket walks
+// packets in the block directly instead of calling pcap_next_ex() per packet.
+//
+// With zero_copy, Packet refers to a frame in the ring instead of copying it.
+// A block is given back to the kernel after the reader finished to walk the
+// block and all packets of the block have been released. A frame received
+// with VLAN tag is always copied because the kernel strips the tag from the
+// frame and it is put back as libpcap does. set_filter() compiles the
+// expression with a live libpcap handle of the device so that "vlan" also
+// matches the stripped tag.
+//
+// Available configs:
+// - block_size:    Size of a ring block in byte (power of 2, >= page size)
+// - block_count:   Number of ring blocks
+// - frame_size:    Frame size hint for the kernel (multiple of 16)
+// - block_timeout: Timeout in msec to retire a block that is not full
+// - zero_copy:     Lend frames in the ring to Packet instead of copying
+// - fanout:        Number of sockets in PACKET_FANOUT group. Each socket is
+//                  created as AfPacket having fanout_group and queue index.
+
+class AfPacket : public Capture, public PacketLender {
+ private:
+  static const size_t VLAN_TAG_LEN = 4;
+
+  std::string dev_name_;
+  int sock_;
+  byte_t* ring_;
+  size_t ring_len_;
+  uint32_t block_size_;
+  uint32_t block_count_;
+  bool zero_copy_;
+  int fanout_;
+  uint16_t fanout_group_;
+  std::atomic<uint32_t>* refs_;  // reference count of each block.
+  uint32_t block_idx_;   // index of block that is read now.
+  byte_t* block_;        // pointer of block that is read now.
+  byte_t* frame_;        // pointer of next frame in the block.
+  uint32_t frame_left_;  // number of frame(s) not read yet in the block.
+  std::vector<byte_t> vlan_frame_;   // frame with 802.1Q tag put back.
+
+  bool setup(const Config& config);
+  void unref_block(uint32_t idx);
+
+ public:
+  AfPacket(const std::string& dev_name, const Config& config,
+           uint16_t fanout_group = 0, size_t queue = 0);
+  ~AfPacket();
+
+  static uint16_t new_fanout_group();
+  Result read(Packet *pkt);
+  Result read_batch(Packet** pkts, size_t n, size_t* count);
+  bool set_filter(const std::string& expr);
+  int selectable_fd() { return this->sock_; }
+  const std::string& src_name() const { return this->dev_name_; }
+  void give_back(const Packet* pkt);
+};
+
+#endif   // __linux__
+
 }   // namespace pm
 
 #endif   // __PACKETMACHINE_CAPTURE_HPP__
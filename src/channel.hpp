@@ -30,51 +30,456 @@
 #include <assert.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <vector>
 #include <atomic>
-#include <deque>
+#include <memory>
+#include <string>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+#include "./packetmachine/common.hpp"
+#include "./packetmachine/config.hpp"
 #include "./packetmachine/exception.hpp"
 #include "./debug.hpp"
 
 namespace pm {
 
-// RingBufferl is thread-safe and high performance data channel between
-// packet capture thread and packet decoding thread.
+// release_data() is called when consumer finished to use data of a slot.
+// Overload it for a slot type that holds resources borrowed from producer
+// (e.g. Packet lent by capture buffer).
+template <typename T>
+inline void release_data(T* data) {
+}
+
+// init_slot() is called when RingBuffer is created with slot_size to give
+// each slot a block of slab. Overload it for a slot type having buffer.
+template <typename T>
+inline void init_slot(T* data, byte_t* buf, size_t len) {
+}
+
+
+// Slab is one contiguous memory region divided into blocks of same size.
+// It is allocated by anonymous mmap, then physical memory is used only for
+// touched pages. With huge_page, MAP_HUGETLB is tried first and then
+// transparent huge page is requested by madvise(). bind_node() makes pages
+// touched after the call allocated on a NUMA node.
+
+class Slab {
+ private:
+  static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+  byte_t* mem_;
+  size_t len_;
+  size_t block_size_;
+
+ public:
+  Slab(size_t count, size_t block_size, bool huge_page) :
+      mem_(nullptr), len_(count * block_size), block_size_(block_size) {
+    void* mem = MAP_FAILED;
+    if (huge_page) {
+      this->len_ = (this->len_ + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+      mem = ::mmap(nullptr, this->len_, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+#endif
+    }
+    if (mem == MAP_FAILED) {
+      mem = ::mmap(nullptr, this->len_, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON, -1, 0);
+      if (mem == MAP_FAILED) {
+        throw Exception::RunTimeError("fail to allocate slab");
+      }
+#ifdef MADV_HUGEPAGE
+      if (huge_page) {
+        ::madvise(mem, this->len_, MADV_HUGEPAGE);
+      }
+#endif
+    }
+    this->mem_ = static_cast<byte_t*>(mem);
+  }
+  ~Slab() {
+    ::munmap(this->mem_, this->len_);
+  }
+  Slab(const Slab&) = delete;
+  Slab& operator=(const Slab&) = delete;
+
+  byte_t* block(size_t idx) const {
+    return this->mem_ + idx * this->block_size_;
+  }
+  size_t block_size() const { return this->block_size_; }
+
+  // Prefer NUMA node for pages of the slab. Return false if not supported.
+  bool bind_node(int node) {
+#if defined(__linux__) && defined(SYS_mbind)
+    unsigned long mask = 0;  // NOLINT, according to mbind(2)
+    if (node < 0 || node >= static_cast<int>(sizeof(mask) * 8)) {
+      return false;
+    }
+    mask = 1UL << node;
+    return (::syscall(SYS_mbind, this->mem_, this->len_, MPOL_PREFERRED,
+                      &mask, sizeof(mask) * 8, 0) == 0);
+#else
+    return false;
+#endif
+  }
+};
+
+// Waiter makes a thread wait until the other side of a channel makes
+// progress. Strategy is chosen by Machine.ring_wait.
+//
+// - SLEEP: usleep() with exponential backoff from sleep_init to sleep_max
+//          usec. Default and same as former behavior.
+// - SPIN:  Busy loop. Lowest latency, but waiting thread uses one core.
+// - YIELD: Spin SPIN_COUNT times, then sched_yield().
+// - PARK:  Spin SPIN_COUNT times, then sleep on futex (condition variable on
+//          non Linux) until notify() by the other side.
+
+class Waiter {
+ public:
+  enum Strategy {
+    SLEEP,
+    SPIN,
+    YIELD,
+    PARK,
+  };
+
+  static const uint32_t SPIN_COUNT = 1024;
+  static const long PARK_TIMEOUT_NS = 100 * 1000 * 1000;  // NOLINT
+
+ private:
+  Strategy strategy_;
+  uint32_t sleep_init_;
+  uint32_t sleep_max_;
+  std::atomic<uint32_t> sleepers_;
+#ifdef __linux__
+  std::atomic<uint32_t> seq_;
+#else
+  pthread_mutex_t lock_;
+  pthread_cond_t cond_;
+#endif
+
+  static inline void relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+#ifndef __linux__
+  static void unlock(void* lock) {
+    pthread_mutex_unlock(static_cast<pthread_mutex_t*>(lock));
+  }
+#endif
+
+  // Sleep until notify() or timeout. ready() is checked again after
+  // sleepers_ is incremented not to miss notify() called between the last
+  // check and sleep.
+  template <typename F>
+  void park(F ready) {
+    this->sleepers_++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+#ifdef __linux__
+    uint32_t seq = this->seq_;
+    if (!ready()) {
+      struct timespec ts = {0, PARK_TIMEOUT_NS};
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&this->seq_),
+              FUTEX_WAIT_PRIVATE, seq, &ts, nullptr, 0);
+    }
+#else
+    pthread_mutex_lock(&this->lock_);
+    pthread_cleanup_push(unlock, &this->lock_);
+    if (!ready()) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += PARK_TIMEOUT_NS;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&this->cond_, &this->lock_, &ts);
+    }
+    pthread_cleanup_pop(1);
+#endif
+    this->sleepers_--;
+  }
+
+ public:
+  Waiter(Strategy strategy, uint32_t sleep_init, uint32_t sleep_max) :
+      strategy_(strategy), sleep_init_(sleep_init), sleep_max_(sleep_max),
+      sleepers_(0) {
+#ifdef __linux__
+    this->seq_ = 0;
+#else
+    pthread_mutex_init(&this->lock_, nullptr);
+    pthread_cond_init(&this->cond_, nullptr);
+#endif
+  }
+  ~Waiter() {
+#ifndef __linux__
+    pthread_cond_destroy(&this->cond_);
+    pthread_mutex_destroy(&this->lock_);
+#endif
+  }
+  Waiter(const Waiter&) = delete;
+  Waiter& operator=(const Waiter&) = delete;
+
+  // Return strategy given by Machine.ring_wait of config, or SLEEP.
+  static Strategy config_strategy(const Config& config) {
+    Strategy strategy = SLEEP;
+    if (config.has("Machine.ring_wait")) {
+      parse(config.get("Machine.ring_wait").as_str(), &strategy);
+    }
+    return strategy;
+  }
+
+  // Convert name of Machine.ring_wait ("sleep", "spin", "yield" or "park").
+  static bool parse(const std::string& name, Strategy* strategy) {
+    if (name == "sleep") {
+      *strategy = SLEEP;
+    } else if (name == "spin") {
+      *strategy = SPIN;
+    } else if (name == "yield") {
+      *strategy = YIELD;
+    } else if (name == "park") {
+      *strategy = PARK;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  Strategy strategy() const { return this->strategy_; }
+
+  // Wait once. round is number of previous pause() calls in current wait
+  // and incremented. ready() returns true if the waited condition is met.
+  template <typename F>
+  void pause(uint32_t* round, F ready) {
+    uint32_t r = (*round)++;
+
+    // Threads are stopped by pthread_cancel(), but spin, sched_yield() and
+    // futex syscall are not cancellation points.
+    if (this->strategy_ != SLEEP) {
+      pthread_testcancel();
+    }
+
+    switch (this->strategy_) {
+      case SLEEP: {
+        uint64_t wait = static_cast<uint64_t>(this->sleep_init_) <<
+                        (r < 31 ? r + 1 : 31);
+        usleep(wait < this->sleep_max_ ? wait : this->sleep_max_);
+        break;
+      }
+      case SPIN:
+        relax();
+        break;
+      case YIELD:
+        if (r < SPIN_COUNT) {
+          relax();
+        } else {
+          sched_yield();
+        }
+        break;
+      case PARK:
+        if (r < SPIN_COUNT) {
+          relax();
+        } else {
+          this->park(ready);
+        }
+        break;
+    }
+  }
+
+  // Wake up thread(s) sleeping in pause(). Cheap if no thread is sleeping.
+  void notify() {
+    if (this->strategy_ != PARK) {
+      return;
+    }
+    // Order publishing of data (release store) before loading sleepers_,
+    // pairs with the fence in park().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (this->sleepers_.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+#ifdef __linux__
+    this->seq_++;
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&this->seq_),
+            FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#else
+    pthread_mutex_lock(&this->lock_);
+    pthread_cond_broadcast(&this->cond_);
+    pthread_mutex_unlock(&this->lock_);
+#endif
+  }
+};
+
+
+// RingBuffer is thread-safe and high performance data channel between
+// packet capture thread and packet decoding thread. It is single producer
+// and single consumer ring.
+//
+// push_idx_ and pull_idx_ are free running counters of pushed and pulled
+// slots and masked by ring size (power of 2) to get slot index. Each side
+// keeps a cached copy of the other side's counter and reloads it only when
+// the ring looks full (producer) or empty (consumer), so the counters'
+// cache lines move between cores only when necessary. A slot returned by
+// pull() belongs to the consumer until next pull() or try_pull().
+//
+// Batch API reserves or takes multiple slots and publishes the counter once
+// per batch: retain_batch() and push_batch() for producer, pull_batch() and
+// release_batch() for consumer.
+//
+// Slot objects are allocated as one array and, with slot_size, buffers of
+// slots are blocks of one Slab given by init_slot().
+//
+// Available configs (validated by Machine):
+// - Machine.ring_size: Number of slots, rounded up to power of 2
+// - Machine.slot_size: Buffer size of each slot in byte. 0 to let a slot
+//                      allocate own buffer on demand
+// - Machine.huge_page: Allocate slab on huge pages
+// - Machine.ring_wait: Wait strategy (see Waiter)
 
 template <typename T>
 class RingBuffer {
  private:
   static const bool DEBUG = false;
+  static const size_t CACHE_LINE = 64;
+  static const uint32_t RING_SIZE = 4096;
+  static const size_t SLOT_SIZE = 2048;
 
+  // Written by producer.
   std::atomic<uint32_t> push_idx_;
+  uint32_t pull_cache_;          // pull_idx_ seen last time by producer.
+  uint64_t push_wait_;
+  char pad1_[CACHE_LINE];
+
+  // Written by consumer.
   std::atomic<uint32_t> pull_idx_;
+  uint32_t read_idx_;            // next slot to be pulled, >= pull_idx_.
+  uint32_t push_cache_;          // push_idx_ seen last time by consumer.
+  uint64_t pull_wait_;
+  char pad2_[CACHE_LINE];
+
+  // Shared.
   std::vector<T*> ring_;
   uint32_t ring_size_;
-  uint64_t push_wait_, pull_wait_;
-  bool eos_;
+  uint32_t mask_;
+  std::atomic<bool> eos_;
+  std::shared_ptr<Waiter> space_waiter_;   // producer waits for free slot.
+  std::shared_ptr<Waiter> data_waiter_;    // consumer waits for data.
+  T* slots_;
+  std::unique_ptr<Slab> slab_;
 
-  inline uint32_t next(uint32_t idx) {
-    debug(DEBUG, "channel=%p", this);
-    assert(idx <= this->ring_size_);
-    return (idx + 1) % this->ring_size_;
+  static uint32_t config_ring_size(const Config& config) {
+    int size = config.has("Machine.ring_size") ?
+               config.get("Machine.ring_size").as_int() : RING_SIZE;
+    uint32_t ring_size = 2;
+    while (static_cast<int>(ring_size) < size) {
+      ring_size <<= 1;
+    }
+    return ring_size;
+  }
+
+  // Number of slots that producer can retain. One slot is kept for data
+  // that consumer pulled last.
+  inline uint32_t free_size(uint32_t push_idx) {
+    uint32_t free_size = this->mask_ - (push_idx - this->pull_cache_);
+    if (free_size == 0) {
+      this->pull_cache_ = this->pull_idx_.load(std::memory_order_acquire);
+      free_size = this->mask_ - (push_idx - this->pull_cache_);
+    }
+    return free_size;
+  }
+
+  // Number of slots that consumer can pull.
+  inline uint32_t data_size(uint32_t pull_idx) {
+    uint32_t data_size = this->push_cache_ - pull_idx;
+    if (data_size == 0) {
+      this->push_cache_ = this->push_idx_.load(std::memory_order_acquire);
+      data_size = this->push_cache_ - pull_idx;
+    }
+    return data_size;
+  }
+
+  // Wait for data and return number of slots having data, or 0 if closed.
+  uint32_t wait_data(uint32_t read_idx) {
+    uint32_t size;
+    uint32_t round = 0;
+    while (0 == (size = this->data_size(read_idx))) {
+      if (this->closed()) {
+        // Check data again because data can be pushed between the check
+        // above and close().
+        size = this->data_size(read_idx);
+        debug(DEBUG && size == 0, "closed");
+        return size;
+      }
+
+      this->pull_wait_ += 1;
+      this->data_waiter_->pause(&round, [this]() {
+          return this->readable() || this->closed();
+        });
+    }
+    return size;
+  }
+
+  uint32_t wait_free(uint32_t push_idx) {
+    uint32_t free_size;
+    uint32_t round = 0;
+    while (0 == (free_size = this->free_size(push_idx))) {
+      this->push_wait_ += 1;
+      this->space_waiter_->pause(&round, [this, push_idx]() {
+          return this->free_size(push_idx) > 0;
+        });
+    }
+    return free_size;
   }
 
  public:
-  RingBuffer() : push_idx_(0), pull_idx_(0), ring_size_(0xfff),
-              push_wait_(0), pull_wait_(0), eos_(false) {
+  // data_waiter can be shared by channels that are read by one consumer
+  // (e.g. Kernel reading multiple data sources).
+  explicit RingBuffer(const Config& config = Config(),
+                      std::shared_ptr<Waiter> data_waiter = nullptr) :
+      push_idx_(0), pull_cache_(0), push_wait_(0),
+      pull_idx_(0), read_idx_(0), push_cache_(0), pull_wait_(0),
+      ring_size_(config_ring_size(config)), mask_(ring_size_ - 1),
+      eos_(false),
+      space_waiter_(new Waiter(Waiter::config_strategy(config), 100, 102400)),
+      data_waiter_(data_waiter ? data_waiter :
+                   std::make_shared<Waiter>(Waiter::config_strategy(config),
+                                            1, 1 << 20)),
+      slots_(new T[ring_size_]) {
     this->ring_.resize(this->ring_size_);
     for (uint32_t i = 0; i < this->ring_size_; i++) {
-      this->ring_[i] = new T();
+      this->ring_[i] = &this->slots_[i];
+    }
+
+    size_t slot_size = config.has("Machine.slot_size") ?
+                       config.get("Machine.slot_size").as_int() : SLOT_SIZE;
+    if (slot_size > 0) {
+      bool huge_page = config.has("Machine.huge_page") &&
+                       config.get("Machine.huge_page").as_bool();
+      slot_size = (slot_size + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+      this->slab_.reset(new Slab(this->ring_size_, slot_size, huge_page));
+      for (uint32_t i = 0; i < this->ring_size_; i++) {
+        init_slot(&this->slots_[i], this->slab_->block(i), slot_size);
+      }
     }
     debug(DEBUG, "channel=%p", this);
-    debug(DEBUG, "push:%u, pull:%u",
-          static_cast<uint32_t>(this->push_idx_),
-          static_cast<uint32_t>(this->pull_idx_));
   }
   ~RingBuffer() {
-    for (uint32_t i = 0; i < this->ring_size_; i++) {
-      delete this->ring_[i];
-    }
+    delete[] this->slots_;
+  }
+
+  uint32_t ring_size() const { return this->ring_size_; }
+  // Allocate slot buffers on NUMA node of the consumer. Must be called
+  // before the first push.
+  bool bind_node(int node) {
+    return (this->slab_ && this->slab_->bind_node(node));
   }
 
   uint64_t push_wait() const { return this->push_wait_; }
@@ -82,119 +487,145 @@ class RingBuffer {
 
   // for data capture thread.
   T* retain() {
-    uint32_t n = this->next(this->push_idx_);
-    debug(DEBUG, "reatin:%u", n);
+    uint32_t idx = this->push_idx_.load(std::memory_order_relaxed);
+    this->wait_free(idx);
+    debug(DEBUG, "retained:%u", idx);
+    return this->ring_[idx & this->mask_];
+  }
 
-    uint32_t wait = 100;
-    while (n == this->pull_idx_) {
-      this->push_wait_ += 1;
-      if (wait < 0xffff) {
-        wait *= 2;
-      }
-      usleep(wait);
+  void push(T *data) {
+    uint32_t idx = this->push_idx_.load(std::memory_order_relaxed);
+    this->ring_[idx & this->mask_] = data;
+    this->push_idx_.store(idx + 1, std::memory_order_release);
+    this->data_waiter_->notify();
+    debug(DEBUG, "push:%u", idx);
+  }
+
+  // Retain up to n free slots at once. Wait until one or more slots are
+  // available and return number of retained slots.
+  size_t retain_batch(T** slots, size_t n) {
+    uint32_t idx = this->push_idx_.load(std::memory_order_relaxed);
+    uint32_t free_size = this->wait_free(idx);
+    if (n > free_size) {
+      n = free_size;
     }
 
-    debug(DEBUG, "retained:%u", n);
-    return this->ring_[n];
-  }
+    for (size_t i = 0; i < n; i++) {
+      slots[i] = this->ring_[(idx + i) & this->mask_];
+    }
 
-  void push(T *data) {
-    uint32_t n = this->next(this->push_idx_);
-    this->ring_[n] = data;
-    this->push_idx_ = n;
-    debug(DEBUG, "push:%u", n);
+    return n;
   }
 
+  // Non-blocking retain_batch(). Return 0 if the ring is full.
+  size_t try_retain_batch(T** slots, size_t n) {
+    uint32_t idx = this->push_idx_.load(std::memory_order_relaxed);
+    uint32_t free_size = this->free_size(idx);
+    if (n > free_size) {
+      n = free_size;
+    }
 
-  // for data processing thread.
-  T* pull() {
-    uint32_t n = this->next(this->pull_idx_);
+    for (size_t i = 0; i < n; i++) {
+      slots[i] = this->ring_[(idx + i) & this->mask_];
+    }
 
-    debug(DEBUG, "push:%u, pull:%u",
-           static_cast<uint32_t>(this->push_idx_),
-           static_cast<uint32_t>(this->pull_idx_));
+    return n;
+  }
 
-    uint32_t wait = 1;
-    while (n == this->next(this->push_idx_)) {
-      if (this->closed()) {
-        debug(DEBUG, "closed");
-        return nullptr;
-      }
+  // Number of slots that have been pushed and not given back by consumer.
+  // Called by producer.
+  uint32_t used_size() {
+    this->pull_cache_ = this->pull_idx_.load(std::memory_order_acquire);
+    return this->push_idx_.load(std::memory_order_relaxed) - this->pull_cache_;
+  }
 
-      this->pull_wait_ += 1;
+  // Publish first count slots retained by retain_batch() at once. Slots may
+  // be reordered by producer (e.g. to skip dropped data), then give number of
+  // retained slots as retained to put unpublished slots back to the ring.
+  void push_batch(T** slots, size_t count, size_t retained = 0) {
+    uint32_t idx = this->push_idx_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count || i < retained; i++) {
+      this->ring_[(idx + i) & this->mask_] = slots[i];
+    }
+    this->push_idx_.store(idx + count, std::memory_order_release);
+    this->data_waiter_->notify();
+    debug(DEBUG, "push:%u", idx);
+  }
 
-      if ((wait & 0xfffff) != 0) {
-        wait = wait << 1;
-      }
-      usleep(wait);
+
+  // for data processing thread.
+  T* pull() {
+    uint32_t idx = this->read_idx_;
+    if (this->wait_data(idx) == 0) {
+      return nullptr;
     }
 
-    T* pkt = this->ring_[n];
-    this->pull_idx_ = n;
+    T* pkt = this->ring_[idx & this->mask_];
+    this->read_idx_ = idx + 1;
+    this->pull_idx_.store(this->read_idx_, std::memory_order_release);
+    this->space_waiter_->notify();
 
     return pkt;
   }
 
-  void release(T* data) {
-    // pass
-  }
+  // Non-blocking pull. Return nullptr if no data is available now.
+  T* try_pull() {
+    uint32_t idx = this->read_idx_;
+    if (this->data_size(idx) == 0) {
+      return nullptr;
+    }
 
-  void close() {
-    this->eos_ = true;
+    T* pkt = this->ring_[idx & this->mask_];
+    this->read_idx_ = idx + 1;
+    this->pull_idx_.store(this->read_idx_, std::memory_order_release);
+    this->space_waiter_->notify();
+    return pkt;
   }
 
-  bool closed() const {
-    return this->eos_;
+  // Take up to n slots at once. Wait until one or more slots have data and
+  // return number of taken slots, or 0 if the ring is closed. Taken slots
+  // belong to the consumer until release_batch().
+  size_t pull_batch(T** slots, size_t n) {
+    uint32_t idx = this->read_idx_;
+    uint32_t data_size = this->wait_data(idx);
+    if (n > data_size) {
+      n = data_size;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      slots[i] = this->ring_[(idx + i) & this->mask_];
+    }
+    this->read_idx_ = idx + n;
+
+    return n;
   }
-};
 
+  // Release data of slots taken by pull_batch() and give all of them back to
+  // producer at once.
+  void release_batch(T** slots, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      release_data(slots[i]);
+    }
+    this->pull_idx_.store(this->read_idx_, std::memory_order_release);
+    this->space_waiter_->notify();
+  }
 
-template <typename T>
-class MsgQueue {
- private:
-  std::atomic<bool> has_msg_;
-  pthread_mutex_t lock_;
-  std::deque<T> queue_;
- public:
-  MsgQueue() : has_msg_(false) {
-    pthread_mutex_init(&this->lock_, nullptr);
+  // Return true if pull() does not wait. Called by consumer.
+  bool readable() {
+    return this->data_size(this->read_idx_) > 0;
   }
-  ~MsgQueue() {
-    pthread_mutex_destroy(&this->lock_);
+
+  void release(T* data) {
+    release_data(data);
   }
 
-  inline bool has_msg() const { return this->has_msg_; }
-  void push(T data) {
-    if (0 != pthread_mutex_lock(&this->lock_)) {
-      throw Exception::RunTimeError("fail to mutex lock");
-    }
-    
-    this->queue_.push_back(data);
-    this->has_msg_ = true;
-    
-    if (0 != pthread_mutex_unlock(&this->lock_)) {
-      throw Exception::RunTimeError("fail to mutex unlock");
-    }
+  void close() {
+    this->eos_.store(true, std::memory_order_release);
+    this->data_waiter_->notify();
   }
 
-  T pull() {
-    if (0 != pthread_mutex_lock(&this->lock_)) {
-      throw Exception::RunTimeError("fail to mutex lock");
-    }
-    
-    if (this->queue_.empty()) {
-      throw Exception::RunTimeError("no data in queue");
-    }
-    T data = this->queue_.front();
-    this->queue_.pop_front();
-    if (this->queue_.empty()) {
-      this->has_msg_ = false;
-    }
-    
-    if (0 != pthread_mutex_unlock(&this->lock_)) {
-      throw Exception::RunTimeError("fail to mutex unlock");
-    }
-    return data;
+  bool closed() const {
+    return this->eos_.load(std::memory_order_acquire);
   }
 };
 
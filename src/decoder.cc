@@ -25,6 +25,12 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <set>
+#include <sstream>
+#include <string>
 #include "./decoder.hpp"
 #include "./packetmachine/property.hpp"
 #include "./debug.hpp"
@@ -43,6 +49,79 @@ Decoder::Decoder(const Config& config, ModMap *mod_map) :
   this->init(config, mod_map);
 }
 
+// BPF expression of key in space, or empty if it can not be expressed.
+static std::string key_filter(const std::string& space, uint16_t key) {
+  std::stringstream expr;
+  if (space == "ethertype") {
+    expr << "ether proto " << key;
+  } else if (space == "ip.proto") {
+    expr << "ip proto " << key << " or ip6 proto " << key;
+  } else if (space == "udp.port") {
+    expr << "udp port " << key;
+  } else if (space == "tcp.port") {
+    expr << "tcp port " << key;
+  }
+  return expr.str();
+}
+
+void Decoder::build_dispatch(const Config& config) {
+  for (auto mod : this->modules_) {
+    for (const auto& b : mod->bindings()) {
+      DispatchTable& table = this->dispatch_[b.first];
+      const mod_id cur = table.lookup(b.second);
+      if (cur != Module::NONE && cur != mod->id()) {
+        std::stringstream errmsg;
+        errmsg << this->modules_[cur]->name() << " and " << mod->name()
+               << " are bound to " << b.first << " " << b.second;
+        throw Exception::ConfigError(errmsg.str());
+      }
+      table.set(b.second, mod->id());
+    }
+  }
+
+  if (!config.has("Machine.dispatch")) {
+    return;
+  }
+
+  // Keys added by config, "space:key=Module" separated by comma. A key
+  // bound to other module is moved to the given one.
+  std::stringstream entries(config.get("Machine.dispatch").as_str());
+  std::string entry;
+  while (std::getline(entries, entry, ',')) {
+    const size_t colon = entry.find(':');
+    const size_t eq = entry.find('=', colon);
+    if (colon == std::string::npos || eq == std::string::npos ||
+        !isdigit(entry[colon + 1])) {
+      throw Exception::ConfigError("'" + entry + "' in Machine.dispatch is "
+                                   "not space:key=Module");
+    }
+
+    const std::string space = entry.substr(0, colon);
+    const std::string name = entry.substr(eq + 1);
+    const std::string kstr = entry.substr(colon + 1, eq - colon - 1);
+    char* end;
+    const unsigned long key = strtoul(kstr.c_str(), &end, 0);
+    if (*end != '\0' || key > 0xffff) {
+      throw Exception::ConfigError("'" + entry + "' in Machine.dispatch has "
+                                   "invalid key");
+    }
+    if (this->dispatch_.find(space) == this->dispatch_.end() &&
+        key_filter(space, 0).empty()) {
+      throw Exception::ConfigError("'" + entry + "' in Machine.dispatch has "
+                                   "unknown space");
+    }
+    auto it = this->mod_map_.find(name);
+    if (it == this->mod_map_.end()) {
+      throw Exception::ConfigError("'" + entry + "' in Machine.dispatch has "
+                                   "unknown module");
+    }
+
+    this->dispatch_[space].set(static_cast<uint16_t>(key), it->second);
+    this->modules_[it->second]->extend_filter(
+        key_filter(space, static_cast<uint16_t>(key)));
+  }
+}
+
 void Decoder::init(const Config& config, ModMap* mod_map) {
   std::map<std::string, Module*> mod_map_local;
   if (!mod_map) {
@@ -109,8 +188,12 @@ void Decoder::init(const Config& config, ModMap* mod_map) {
     }
   }
 
-  // Check config keys
+  // Check config keys. Keys of Machine are validated by Machine.
   for (const auto &conf : config.map()) {
+    if (conf.first.compare(0, 8, "Machine.") == 0) {
+      continue;
+    }
+
     if (this->config_map_.find(conf.first) == this->config_map_.end()) {
       std::stringstream errmsg;
       errmsg << "'" << conf.first << "' is not valid config key";
@@ -118,6 +201,8 @@ void Decoder::init(const Config& config, ModMap* mod_map) {
     }
   }
   
+  this->build_dispatch(config);
+
   // Setup modules.
   for (auto &mod : this->modules_) {
     Config local_config;
@@ -161,13 +246,18 @@ Decoder::~Decoder() {
 }
 
 
-void Decoder::decode(Payload* pd, Property* prop) {
+void Decoder::decode(Payload* pd, Property* prop,
+                     const std::vector<uint8_t>* needed) {
   Module* mod;
   mod_id next = this->mod_ethernet_;
 
   // debug(true, "decoding");
 
   while (next != Module::NONE) {
+    if (needed && !(*needed)[next]) {
+      break;
+    }
+
     // debug(true, "next = %lld", next);
     mod = this->modules_[next];
     prop->push_event(this->mod_event_[next]);
@@ -178,6 +268,25 @@ void Decoder::decode(Payload* pd, Property* prop) {
   }
 }
 
+const DispatchTable* Decoder::dispatch_table(const std::string& space) {
+  return &this->dispatch_[space];
+}
+
+std::vector<mod_id> Decoder::bound_modules(const std::string& space) const {
+  std::vector<mod_id> mods;
+  auto it = this->dispatch_.find(space);
+  if (it != this->dispatch_.end()) {
+    for (size_t key = 0; key <= 0xffff; key++) {
+      const mod_id mid = it->second.lookup(static_cast<uint16_t>(key));
+      if (mid != Module::NONE &&
+          std::find(mods.begin(), mods.end(), mid) == mods.end()) {
+        mods.push_back(mid);
+      }
+    }
+  }
+  return mods;
+}
+
 mod_id Decoder::lookup_module(const std::string& name) const {
   auto it = this->mod_map_.find(name);
   if (it == this->mod_map_.end()) {
@@ -235,4 +344,81 @@ const std::string& Decoder::lookup_event_name(event_id eid) const {
   }
 }
 
+bool Decoder::is_stateful_event(event_id eid) const {
+  if (eid < 0 || static_cast<event_id>(this->events_.size()) <= eid) {
+    throw Exception::IndexError("No such parameter");
+  } else {
+    return this->events_[eid]->is_stateful();
+  }
+}
+
+std::string Decoder::build_filter(const std::vector<event_id>& events) const {
+  // std::set makes the expression independent from order of events.
+  std::set<std::string> exprs;
+  for (auto eid : events) {
+    if (eid < 0 || static_cast<event_id>(this->events_.size()) <= eid) {
+      throw Exception::IndexError("No such event");
+    }
+
+    const Module* mod = this->modules_[this->events_[eid]->module_id()];
+    if (mod->filter().empty()) {
+      return "";
+    }
+    exprs.insert(mod->filter());
+  }
+
+  if (exprs.empty()) {
+    return "";
+  }
+
+  // Keyword "pppoes" shifts offsets of following terms and can not be
+  // combined with other terms safely, then all PPPoE session frames pass.
+  exprs.insert("ether proto 0x8864");
+
+  std::string expr;
+  for (const auto& e : exprs) {
+    if (!expr.empty()) {
+      expr += " or ";
+    }
+    expr += (exprs.size() > 1) ? "(" + e + ")" : e;
+  }
+
+  // Also match packets with 802.1Q or 802.1ad tag, and QinQ packets having
+  // two tags. "vlan" must come last because it shifts offsets of following
+  // terms in the expression.
+  return expr + " or (vlan and (" + expr + " or (vlan and (" + expr + "))))";
+}
+
+std::vector<uint8_t>
+Decoder::needed_modules(const std::vector<event_id>& events) const {
+  std::vector<uint8_t> needed(this->modules_.size(), 0);
+  for (auto eid : events) {
+    if (eid < 0 || static_cast<event_id>(this->events_.size()) <= eid) {
+      throw Exception::IndexError("No such event");
+    }
+    needed[this->events_[eid]->module_id()] = 1;
+  }
+
+  // A module is needed if any of next modules is needed. Repeat until no
+  // change because the graph can have a cycle.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t mid = 0; mid < this->modules_.size(); mid++) {
+      if (needed[mid]) {
+        continue;
+      }
+      for (auto next : this->modules_[mid]->next_modules()) {
+        if (needed[next]) {
+          needed[mid] = 1;
+          changed = true;
+          break;
+        }
+      }
+    }
+  }
+
+  return needed;
+}
+
 }   // namespace pm
@@ -62,14 +62,26 @@ class Decoder {
   std::vector<const EventDef*> mod_event_;
   mod_id mod_ethernet_;
   bool initialized_;
+  // Dispatch tables by key space (see Module::bind()).
+  std::map<std::string, DispatchTable> dispatch_;
+
+  void build_dispatch(const Config& config);
+
   
  public:
   Decoder(const Config& config, ModMap *mod_map = nullptr);
   Decoder(ModMap *mod_map = nullptr);
   ~Decoder();
   void init(const Config& config, ModMap *mod_map);
-  void decode(Payload* pd, Property* prop);
+  // Decode packet from Ethernet. If needed is given, a module is decoded
+  // only if needed[mod_id] is not 0 (see needed_modules()).
+  void decode(Payload* pd, Property* prop,
+              const std::vector<uint8_t>* needed = nullptr);
   mod_id lookup_module(const std::string& name) const;
+  // Table of key space. An empty table is returned for unknown space.
+  const DispatchTable* dispatch_table(const std::string& space);
+  // Modules having key(s) in the table of space.
+  std::vector<mod_id> bound_modules(const std::string& space) const;
 
   size_t param_size() const { return this->params_.size(); }
   param_id lookup_param_id(const std::string& name) const;
@@ -79,6 +91,15 @@ class Decoder {
   size_t event_size() const { return this->events_.size(); }
   event_id lookup_event_id(const std::string& name) const;
   const std::string& lookup_event_name(event_id eid) const;
+  bool is_stateful_event(event_id eid) const;
+  // Build BPF expression matching packets that can trigger any of events.
+  // Empty string is returned if the events can not be narrowed.
+  std::string build_filter(const std::vector<event_id>& events) const;
+  // Return flags of modules needed to trigger any of events, indexed by
+  // mod_id: modules of the events and their ancestors in dispatch graph
+  // (edges by Module::lookup_module()).
+  std::vector<uint8_t> needed_modules(const std::vector<event_id>& events)
+      const;
 };
 
 }   // namespace pm
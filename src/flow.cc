@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2017 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp> All
+ * rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <string.h>
+
+#include "./flow.hpp"
+
+namespace pm {
+
+static const uint16_t ETHERTYPE_IPV4   = 0x0800;
+static const uint16_t ETHERTYPE_IPV6   = 0x86dd;
+static const uint16_t ETHERTYPE_VLAN   = 0x8100;
+static const uint16_t ETHERTYPE_QINQ   = 0x88a8;
+static const uint16_t ETHERTYPE_PPPOES = 0x8864;
+static const uint16_t PPP_IPV4 = 0x0021;
+static const uint16_t PPP_IPV6 = 0x0057;
+
+static inline uint16_t get16(const byte_t* p) {
+  return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t fnv1a(uint32_t h, const byte_t* p, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 16777619u;
+  }
+  return h;
+}
+
+uint32_t flow_hash(const byte_t* data, size_t len) {
+  if (len < 14) {
+    return 0;
+  }
+
+  size_t off = 14;
+  uint16_t type = get16(data + 12);
+  while (type == ETHERTYPE_VLAN || type == ETHERTYPE_QINQ) {
+    if (len < off + 4) {
+      return 0;
+    }
+    type = get16(data + off + 2);
+    off += 4;
+  }
+
+  if (type == ETHERTYPE_PPPOES) {
+    // 6 bytes of PPPoE header and 2 bytes of PPP protocol.
+    if (len < off + 8) {
+      return 0;
+    }
+    uint16_t proto = get16(data + off + 6);
+    type = (proto == PPP_IPV4 ? ETHERTYPE_IPV4 :
+            proto == PPP_IPV6 ? ETHERTYPE_IPV6 : 0);
+    off += 8;
+  }
+
+  const byte_t *src, *dst;
+  size_t addr_len, l4;
+  uint8_t proto;
+  bool frag;
+
+  if (type == ETHERTYPE_IPV4) {
+    if (len < off + 20) {
+      return 0;
+    }
+    const byte_t* hdr = data + off;
+    proto = hdr[9];
+    frag = (get16(hdr + 6) & 0x3fff) != 0;   // MF flag or fragment offset.
+    src = hdr + 12;
+    dst = hdr + 16;
+    addr_len = 4;
+    l4 = off + (hdr[0] & 0x0f) * 4;
+  } else if (type == ETHERTYPE_IPV6) {
+    if (len < off + 40) {
+      return 0;
+    }
+    const byte_t* hdr = data + off;
+    proto = hdr[6];
+    frag = (proto == 44);   // Fragment header.
+    src = hdr + 8;
+    dst = hdr + 24;
+    addr_len = 16;
+    l4 = off + 40;
+  } else {
+    return 0;
+  }
+
+  // Ports of TCP, UDP and SCTP. Extension headers of IPv6 are not followed.
+  uint16_t sport = 0, dport = 0;
+  if (!frag && (proto == 6 || proto == 17 || proto == 132) &&
+      len >= l4 + 4) {
+    sport = get16(data + l4);
+    dport = get16(data + l4 + 2);
+  }
+
+  // Order endpoints so that both directions are hashed in same way.
+  int cmp = ::memcmp(src, dst, addr_len);
+  if (cmp > 0 || (cmp == 0 && sport > dport)) {
+    const byte_t* tmp_addr = src;
+    src = dst;
+    dst = tmp_addr;
+    uint16_t tmp_port = sport;
+    sport = dport;
+    dport = tmp_port;
+  }
+
+  const byte_t ports[5] = {
+    static_cast<byte_t>(sport >> 8), static_cast<byte_t>(sport),
+    static_cast<byte_t>(dport >> 8), static_cast<byte_t>(dport), proto,
+  };
+  uint32_t h = 2166136261u;
+  h = fnv1a(h, src, addr_len);
+  h = fnv1a(h, dst, addr_len);
+  h = fnv1a(h, ports, sizeof(ports));
+
+  // Mix upper bits into lower ones, hash is used as modulo of small number.
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  return h;
+}
+
+}   // namespace pm
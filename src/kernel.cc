@@ -33,8 +33,10 @@
 
 namespace pm {
 
-HandlerEntity::HandlerEntity(hdlr_id hid, Callback cb, event_id ev_id) :
-    cb_(cb), ev_id_(ev_id), id_(hid), active_(true), destroyed_(false) {
+HandlerEntity::HandlerEntity(hdlr_id hid, Callback cb, event_id ev_id,
+                             bool async) :
+    cb_(cb), ev_id_(ev_id), id_(hid), active_(true), destroyed_(false),
+    async_(async) {
 }
 HandlerEntity::~HandlerEntity() {
 }
@@ -67,72 +69,340 @@ bool HandlerEntity::destroy() {
   return true;
 }  
 
-bool AddHandler::change(Kernel* kernel) {
-  return kernel->add_handler(this->ptr_);
+void HandlerTable::compile(const Decoder& dec) {
+  const size_t ev_size = this->handlers.size();
+  std::vector<event_id> events;
+  this->entries.clear();
+  this->offset.assign(ev_size + 1, 0);
+  this->event_mask.assign(ev_size / 64 + 1, 0);
+
+  for (size_t eid = 0; eid < ev_size; eid++) {
+    this->offset[eid] = static_cast<uint32_t>(this->entries.size());
+    for (const auto& ptr : this->handlers[eid]) {
+      Entry entry = {&ptr->callback(), ptr.get(), &ptr};
+      this->entries.push_back(entry);
+      this->event_mask[eid / 64] |= (1ULL << (eid % 64));
+    }
+    if (!this->handlers[eid].empty()) {
+      events.push_back(static_cast<event_id>(eid));
+    }
+  }
+  this->offset[ev_size] = static_cast<uint32_t>(this->entries.size());
+  this->modules = dec.needed_modules(events);
 }
 
-bool DeleteHandler::change(Kernel* kernel) {
-  return kernel->delete_handler(this->ptr_);
+// --------------------------------------------------------
+// AsyncExecutor: calls asynchronous handlers
+
+void AsyncExecutor::thread_main() {
+  Snapshot* snapshot;
+  while (nullptr != (snapshot = this->ring_.pull())) {
+    for (const auto& entry : snapshot->handlers) {
+      if (entry->is_active()) {
+        (entry->callback())(snapshot->prop);
+      }
+    }
+    this->ring_.release(snapshot);
+  }
 }
 
-
 // --------------------------------------------------------
 // Kenrel: main process of PacketMachine
 
-Kernel::Kernel(const Config& config) :
-    pkt_channel_(new RingBuffer<Packet>),
-    msg_channel_(new MsgQueue<ChangeRequest*>),
+Kernel::Kernel(const Config& config, size_t worker) :
     dec_(new Decoder(config)),
-    recv_pkt_(0), recv_size_(0), global_hdlr_id_(0), running_(false) {
-  this->handlers_.resize(this->dec_->event_size());
+    recv_pkt_(0), recv_size_(0), global_hdlr_id_(0), worker_(worker),
+    table_(new HandlerTable), in_use_(nullptr),
+    merge_(false), last_ch_(0), rr_idx_(0), config_(config),
+    wait_strategy_(Waiter::config_strategy(config)), prune_(false),
+    executor_joined_(false), async_block_(true), async_drop_(0) {
+  pthread_mutex_init(&this->table_lock_, nullptr);
+  this->table_.load()->handlers.resize(this->dec_->event_size());
+  this->table_.load()->compile(*this->dec_);
+
+  this->waiter_ = std::make_shared<Waiter>(this->wait_strategy_, 1, 1 << 20);
+  this->add_pkt_channel();
+
+  if (config.has("Machine.prune_decode")) {
+    this->prune_ = config.get("Machine.prune_decode").as_bool();
+  }
+  if (config.has("Machine.async_overflow")) {
+    this->async_block_ =
+        (config.get("Machine.async_overflow").as_str() != "drop");
+  }
 }
 Kernel::~Kernel() {
+  // Snapshots may have buffers of packet channels.
+  if (this->executor_ && !this->executor_joined_) {
+    this->executor_->stop();
+  }
+  this->executor_.reset();
+
+  for (auto table : this->retired_) {
+    delete table;
+  }
+  delete this->table_.load();
+  pthread_mutex_destroy(&this->table_lock_);
+}
+
+PktChannel Kernel::add_pkt_channel() {
+  this->pkt_channels_.push_back(
+      PktChannel(new RingBuffer<Packet>(this->config_, this->waiter_)));
+  return this->pkt_channels_.back();
+}
+
+Packet* Kernel::next_packet(size_t* ch_idx) {
+  if (this->pkt_channels_.size() == 1) {
+    *ch_idx = 0;
+    return this->pkt_channels_[0]->pull();
+  } else if (this->merge_) {
+    return this->next_merged(ch_idx);
+  } else {
+    return this->next_arrived(ch_idx);
+  }
+}
+
+Packet* Kernel::next_merged(size_t* ch_idx) {
+  // Compare timestamp, and channel index for same timestamp to keep order of
+  // data sources.
+  auto later = [this](size_t a, size_t b) {
+    const timeval& ta = this->heads_[a]->tv();
+    const timeval& tb = this->heads_[b]->tv();
+    if (ta.tv_sec != tb.tv_sec) {
+      return ta.tv_sec > tb.tv_sec;
+    } else if (ta.tv_usec != tb.tv_usec) {
+      return ta.tv_usec > tb.tv_usec;
+    }
+    return a > b;
+  };
+
+  if (this->heads_.empty()) {
+    // First call, wait for head packet of all channels.
+    this->heads_.resize(this->pkt_channels_.size(), nullptr);
+    for (size_t i = 0; i < this->pkt_channels_.size(); i++) {
+      if (nullptr != (this->heads_[i] = this->pkt_channels_[i]->pull())) {
+        this->heap_.push_back(i);
+      }
+    }
+    std::make_heap(this->heap_.begin(), this->heap_.end(), later);
+  } else {
+    // Refill head of the channel that was consumed last time.
+    size_t i = this->last_ch_;
+    if (nullptr != (this->heads_[i] = this->pkt_channels_[i]->pull())) {
+      this->heap_.push_back(i);
+      std::push_heap(this->heap_.begin(), this->heap_.end(), later);
+    }
+  }
+
+  if (this->heap_.empty()) {
+    return nullptr;  // all channels are closed.
+  }
+
+  std::pop_heap(this->heap_.begin(), this->heap_.end(), later);
+  size_t i = this->heap_.back();
+  this->heap_.pop_back();
+
+  this->last_ch_ = i;
+  *ch_idx = i;
+  return this->heads_[i];
+}
+
+Packet* Kernel::next_arrived(size_t* ch_idx) {
+  const size_t n = this->pkt_channels_.size();
+  uint32_t round = 0;
+
+  for (;;) {
+    bool alive = false;
+    for (size_t k = 0; k < n; k++) {
+      size_t i = (this->rr_idx_ + k) % n;
+      // Check closed before pull not to miss data pushed before close.
+      bool closed = this->pkt_channels_[i]->closed();
+      Packet* pkt = this->pkt_channels_[i]->try_pull();
+      if (pkt) {
+        this->rr_idx_ = (i + 1) % n;
+        *ch_idx = i;
+        return pkt;
+      }
+      if (!closed) {
+        alive = true;
+      }
+    }
+
+    if (!alive) {
+      return nullptr;
+    }
+
+    if (this->wait_strategy_ == Waiter::SLEEP) {
+      usleep(1);
+    } else {
+      this->waiter_->pause(&round, [this]() {
+          for (auto& ch : this->pkt_channels_) {
+            if (ch->readable() || ch->closed()) {
+              return true;
+            }
+          }
+          return false;
+        });
+    }
+  }
+}
+
+const HandlerTable* Kernel::pick_table() {
+  const HandlerTable* table = this->table_.load(std::memory_order_acquire);
+  while (table != this->in_use_.load(std::memory_order_relaxed)) {
+    // Announce the table before reading it, then check that it was not
+    // replaced meanwhile. publish() may have deleted it if it was.
+    this->in_use_.store(table);
+    table = this->table_.load();
+  }
+  return table;
+}
+
+void Kernel::publish(HandlerTable* table) {
+  table->compile(*this->dec_);
+  // Sequentially consistent with pick_table(): Kernel thread either sees the
+  // new table, or announced the old one before in_use_ is loaded below.
+  this->retired_.push_back(this->table_.exchange(table));
+
+  const HandlerTable* in_use = this->in_use_.load();
+  auto it = std::remove_if(this->retired_.begin(), this->retired_.end(),
+                           [in_use](HandlerTable* t) {
+                             if (t != in_use) {
+                               delete t;
+                               return true;
+                             }
+                             return false;
+                           });
+  this->retired_.erase(it, this->retired_.end());
+}
+
+void Kernel::process(Packet* pkt, const HandlerTable* table, Payload* pd,
+                     Property* prop) {
+  this->recv_pkt_  += 1;
+  this->recv_size_ += pkt->cap_len();
+
+  prop->init(pkt);
+  pd->reset(pkt);
+  this->dec_->decode(pd, prop, this->prune_ ? &table->modules : nullptr);
+
+  // Event handler
+  const size_t ev_size = prop->event_idx();
+  const HandlerTable::Entry* entries = table->entries.data();
+  for (size_t i = 0; i < ev_size; i++) {
+    const event_id eid = prop->event(i)->id();
+    if (!table->has_handler(eid)) {
+      continue;
+    }
+
+    const HandlerTable::Entry* end = entries + table->offset[eid + 1];
+    for (auto it = entries + table->offset[eid]; it != end; ++it) {
+      if (!it->hdlr->is_active()) {
+        continue;
+      } else if (it->hdlr->is_async()) {
+        this->async_hdlrs_.push_back(*it->ptr);
+      } else {
+        (*it->cb)(*prop);
+      }
+    }
+  }
+
+  if (!this->async_hdlrs_.empty()) {
+    this->hand_off(pkt, prop);
+  }
+}
+
+void Kernel::hand_off(Packet* pkt, Property* prop) {
+  if (!this->executor_) {
+    Config config(this->config_);
+    config.set("Machine.ring_size", this->config_.has("Machine.async_queue") ?
+               this->config_.get("Machine.async_queue").as_int() : 1024);
+    config.set("Machine.slot_size", 0);
+    this->executor_.reset(new AsyncExecutor(config));
+    this->executor_->start();
+  }
+
+  RingBuffer<Snapshot>& ring = this->executor_->ring();
+  Snapshot* snapshot;
+  if (this->async_block_) {
+    ring.retain_batch(&snapshot, 1);
+  } else if (ring.try_retain_batch(&snapshot, 1) == 0) {
+    this->async_drop_ += 1;
+    this->async_hdlrs_.clear();
+    return;
+  }
+
+  // The channel slot takes the buffer that the snapshot had.
+  snapshot->pkt.swap(pkt);
+  snapshot->prop.swap(prop);
+  snapshot->prop.set_decoder(this->dec_);
+  snapshot->prop.set_worker(this->worker_);
+  snapshot->prop.detach();
+  snapshot->handlers.swap(this->async_hdlrs_);
+  ring.push_batch(&snapshot, 1);
+}
+
+void Kernel::start() {
+  // Slot buffers are not touched yet, then pages are allocated on NUMA node
+  // of the pinned Kernel thread that reads them.
+  if (this->cpu() >= 0) {
+    const int node = Thread::cpu_node(this->cpu());
+    for (auto& ch : this->pkt_channels_) {
+      ch->bind_node(node);
+    }
+  }
+  Thread::start();
 }
 
 void Kernel::thread_main() {
   Packet* pkt;
   Payload pd;
   Property prop;
-  
-  this->running_ = true;
+  size_t ch_idx;
   
   prop.set_decoder(this->dec_);
-  
-  while (nullptr != (pkt = this->pkt_channel_->pull())) {
-    this->recv_pkt_  += 1;
-    this->recv_size_ += pkt->cap_len();
-
-    prop.init(pkt);
-    pd.reset(pkt);
-    this->dec_->decode(&pd, &prop);
-
-    // Event handler
-    size_t ev_size = prop.event_idx();
-    for (size_t i = 0; i < ev_size; i++) {
-      event_id eid = prop.event(i)->id();
-      for (auto entry : this->handlers_[eid]) {
-        if (entry != nullptr && entry->is_active()) {
-          (entry->callback())(prop);
-        }
+  prop.set_worker(this->worker_);
+
+  if (this->pkt_channels_.size() == 1) {
+    // Take packets per batch and give back ring slots (and lent packet data)
+    // at once after processing the batch.
+    PktChannel& ch = this->pkt_channels_[0];
+    Packet* pkts[PULL_BATCH];
+    size_t n;
+    while (0 < (n = ch->pull_batch(pkts, PULL_BATCH))) {
+      const HandlerTable* table = this->pick_table();
+      for (size_t i = 0; i < n; i++) {
+        this->process(pkts[i], table, &pd, &prop);
       }
+      ch->release_batch(pkts, n);
     }
-
-    // Handle change request(s)
-    if (this->msg_channel_->has_msg()) {
-      ChangeRequest *req;
-      while(this->msg_channel_->has_msg()) {
-        req = this->msg_channel_->pull();
-        req->change(this);
-        delete req;
+  } else {
+    // Pick up handler changes per PULL_BATCH packets as the path above.
+    const HandlerTable* table = nullptr;
+    size_t picked = 0;
+    while (nullptr != (pkt = this->next_packet(&ch_idx))) {
+      if (picked++ % PULL_BATCH == 0) {
+        table = this->pick_table();
       }
+      this->process(pkt, table, &pd, &prop);
+
+      // Give back lent packet data to capture.
+      this->pkt_channels_[ch_idx]->release(pkt);
     }
   }
 
-  this->running_ = false;
+  // Wait for asynchronous handlers of all packets.
+  if (this->executor_) {
+    this->executor_->ring().close();
+    this->executor_->join();
+    this->executor_joined_ = true;
+  }
+
+  this->in_use_.store(nullptr, std::memory_order_release);
 }
 
 
-HandlerPtr Kernel::on(const std::string& event_name, Callback&& cb) {
+HandlerPtr Kernel::on(const std::string& event_name, Callback&& cb,
+                      bool async) {
   event_id eid = this->dec_->lookup_event_id(event_name);
 
   if (eid == Event::NONE) {
@@ -140,68 +410,178 @@ HandlerPtr Kernel::on(const std::string& event_name, Callback&& cb) {
   }
 
   hdlr_id hid = ++(this->global_hdlr_id_);
-  HandlerPtr entry(new HandlerEntity(hid, cb, eid));
+  HandlerPtr entry(new HandlerEntity(hid, cb, eid, async));
+  this->add(entry);
+  return entry;
+}
 
-  if (this->running_) {
-    auto *req = new AddHandler(entry);
-    this->msg_channel_->push(req);
-  } else {
-    this->add_handler(entry);
+void Kernel::add(HandlerPtr ptr) {
+  this->add_handler(ptr);
+}
+
+void Kernel::copy_handlers(const Kernel& src) {
+  // Event IDs are same in all kernels because all decoders are built from
+  // same module set.
+  pthread_mutex_lock(&src.table_lock_);
+  std::vector<HandlerPtr> entries;
+  for (const auto& handler_set : src.table_.load()->handlers) {
+    entries.insert(entries.end(), handler_set.begin(), handler_set.end());
   }
-  return entry;
+  pthread_mutex_unlock(&src.table_lock_);
+
+  for (const auto& entry : entries) {
+    this->add(entry);
+  }
+  this->global_hdlr_id_ = src.global_hdlr_id_;
 }
 
 bool Kernel::clear(hdlr_id hid) {
+  pthread_mutex_lock(&this->table_lock_);
   auto it = this->handler_map_.find(hid);
   if (it == this->handler_map_.end()) {
+    pthread_mutex_unlock(&this->table_lock_);
     return false;  // not found
   }
 
   auto entry = it->second;
   this->handler_map_.erase(it);
-  event_id eid = entry->ev_id();
-  auto& handler_set = this->handlers_[eid];
-  for (size_t i = 0; i < handler_set.size(); i++) {
-    if (handler_set[i] != nullptr &&
-        handler_set[i]->id() == entry->id()) {
-      handler_set[i] = nullptr;
-      break;
-    }
-  }
+  HandlerTable* table = new HandlerTable(*this->table_.load());
+  auto& arr = table->handlers[entry->ev_id()];
+  arr.erase(std::remove(arr.begin(), arr.end(), entry), arr.end());
+  this->publish(table);
+  pthread_mutex_unlock(&this->table_lock_);
 
   return true;
 }
 
 bool Kernel::clear(HandlerPtr ptr) {
-  if (this->running_) {
-    auto req = new DeleteHandler(ptr);
-    this->msg_channel_->push(req);
-    return true;
-  } else {
-    return this->delete_handler(ptr);
-  }
+  return this->delete_handler(ptr);
 }
 
 
 bool Kernel::add_handler(HandlerPtr ptr) {
+  pthread_mutex_lock(&this->table_lock_);
+  HandlerTable* table = new HandlerTable(*this->table_.load());
+  table->handlers[ptr->ev_id()].push_back(ptr);
   this->handler_map_.insert(std::make_pair(ptr->id(), ptr));
-  this->handlers_[ptr->ev_id()].push_back(ptr);
+  this->publish(table);
+  pthread_mutex_unlock(&this->table_lock_);
   return true;
 }
 
 bool Kernel::delete_handler(HandlerPtr ptr) {
-  event_id eid = ptr->ev_id();
-  auto& arr = this->handlers_[eid];
-  std::vector<HandlerPtr>::iterator tgt = std::find(arr.begin(), arr.end(), ptr);
-  if (tgt == arr.end()) {
+  pthread_mutex_lock(&this->table_lock_);
+  const auto& cur = this->table_.load()->handlers[ptr->ev_id()];
+  if (std::find(cur.begin(), cur.end(), ptr) == cur.end()) {
+    pthread_mutex_unlock(&this->table_lock_);
     return false;
   }
 
-  (*tgt)->destroy();
-  arr.erase(tgt);
+  // Deactivate first, then packets of current batch processed by the old
+  // table do not call the handler anymore.
+  ptr->destroy();
+  HandlerTable* table = new HandlerTable(*this->table_.load());
+  auto& arr = table->handlers[ptr->ev_id()];
+  arr.erase(std::find(arr.begin(), arr.end(), ptr));
+  this->handler_map_.erase(ptr->id());
+  this->publish(table);
+  pthread_mutex_unlock(&this->table_lock_);
 
   return true;
 }
 
+std::vector<event_id> Kernel::events() const {
+  std::vector<event_id> events;
+  pthread_mutex_lock(&this->table_lock_);
+  const HandlerTable* table = this->table_.load();
+  for (size_t eid = 0; eid < table->handlers.size(); eid++) {
+    if (!table->handlers[eid].empty()) {
+      events.push_back(static_cast<event_id>(eid));
+    }
+  }
+  pthread_mutex_unlock(&this->table_lock_);
+  return events;
+}
+
+
+
+// --------------------------------------------------------
+// KernelGroup: set of kernels decoding packets in parallel
+
+KernelGroup::KernelGroup(const Config& config) : config_(config) {
+  this->kernels_.push_back(std::make_shared<Kernel>(config));
+}
+
+KernelGroup::~KernelGroup() {
+}
+
+void KernelGroup::resize(size_t size) {
+  while (this->kernels_.size() < size) {
+    auto kernel = std::make_shared<Kernel>(this->config_,
+                                           this->kernels_.size());
+    kernel->copy_handlers(*(this->kernels_[0]));
+    this->kernels_.push_back(kernel);
+  }
+}
+
+void KernelGroup::start() {
+  for (auto& k : this->kernels_) {
+    k->start();
+  }
+}
+
+void KernelGroup::join() {
+  for (auto& k : this->kernels_) {
+    k->join();
+  }
+}
+
+void KernelGroup::stop() {
+  for (auto& k : this->kernels_) {
+    k->stop();
+  }
+}
+
+HandlerPtr KernelGroup::on(const std::string& event_name,
+                           Callback&& ev_callback, bool async) {
+  HandlerPtr ptr = this->kernels_[0]->on(event_name, std::move(ev_callback),
+                                         async);
+  for (size_t i = 1; i < this->kernels_.size(); i++) {
+    this->kernels_[i]->add(ptr);
+  }
+  return ptr;
+}
+
+bool KernelGroup::clear(HandlerPtr ptr) {
+  bool rc = true;
+  for (auto& k : this->kernels_) {
+    rc = k->clear(ptr) && rc;
+  }
+  return rc;
+}
+
+uint64_t KernelGroup::recv_pkt() const {
+  uint64_t sum = 0;
+  for (const auto& k : this->kernels_) {
+    sum += k->recv_pkt();
+  }
+  return sum;
+}
+
+uint64_t KernelGroup::async_drop() const {
+  uint64_t sum = 0;
+  for (const auto& k : this->kernels_) {
+    sum += k->async_drop();
+  }
+  return sum;
+}
+
+uint64_t KernelGroup::recv_size() const {
+  uint64_t sum = 0;
+  for (const auto& k : this->kernels_) {
+    sum += k->recv_size();
+  }
+  return sum;
+}
 
 }   // namespace pm
@@ -50,87 +50,235 @@ class HandlerEntity {
   hdlr_id id_;
   std::atomic<bool> active_;
   std::atomic<bool> destroyed_;
+  bool async_;
   
  public:
-  HandlerEntity(hdlr_id id, Callback cb, event_id ev_id);
+  HandlerEntity(hdlr_id id, Callback cb, event_id ev_id, bool async = false);
   ~HandlerEntity();
   inline hdlr_id id() const { return this->id_; }
   inline event_id ev_id() const { return this->ev_id_; }
+  inline bool is_async() const { return this->async_; }
   inline Callback& callback() { return this->cb_; }
-  inline bool is_active() const { return this->active_; }
+  inline bool is_active() const {
+    return this->active_.load(std::memory_order_relaxed);
+  }
   bool activate();
   bool deactivate();
   bool destroy();
 };
 
-class ChangeRequest {
- public:
-  ChangeRequest() = default;
-  virtual ~ChangeRequest() = default;
-  virtual bool change(Kernel* kernel) = 0;
-};
-
-
 typedef std::shared_ptr<HandlerEntity> HandlerPtr;
 typedef std::shared_ptr<RingBuffer<Packet> > PktChannel;
-typedef std::shared_ptr<MsgQueue<ChangeRequest*> > MsgChannel;
 
+// HandlerTable is set of handlers indexed by event ID. A table is not
+// modified after it is published to Kernel thread. Adding or deleting a
+// handler publishes a new copy of the table instead.
+//
+// compile() flattens handlers into one contiguous array of entries ordered by
+// event ID and sets a bit of event_mask for each event having handler(s).
+// Kernel thread walks only the array, and an event without handler costs one
+// bit test. HandlerPtr (and its reference count) is not touched except for
+// asynchronous handlers. It also computes modules needed by the events for
+// pruning decode (Machine.prune_decode).
 
+struct HandlerTable {
+  struct Entry {
+    Callback* cb;
+    HandlerEntity* hdlr;
+    const HandlerPtr* ptr;   // element of handlers.
+  };
 
-class AddHandler : public ChangeRequest {
- private:
-  HandlerPtr ptr_;
- public:
-  AddHandler(HandlerPtr ptr) : ptr_(ptr) {}
-  bool change(Kernel *kernel);
+  std::vector< std::vector<HandlerPtr> > handlers;
+
+  // Compiled from handlers. Entries of event eid are from offset[eid] to
+  // offset[eid + 1] - 1.
+  std::vector<Entry> entries;
+  std::vector<uint32_t> offset;
+  std::vector<uint64_t> event_mask;
+  std::vector<uint8_t> modules;   // by Decoder::needed_modules().
+
+  void compile(const Decoder& dec);
+  bool has_handler(event_id eid) const {
+    return (this->event_mask[eid / 64] >> (eid % 64)) & 1;
+  }
 };
 
-class DeleteHandler : public ChangeRequest {
+
+// Snapshot is a decoded packet handed over from Kernel to AsyncExecutor.
+// Kernel moves its Property and Packet contents into a Snapshot by swap()
+// instead of copying values, and then copies only values referring memory
+// out of the packet data (Property::detach()).
+
+struct Snapshot {
+  Packet pkt;
+  Property prop;
+  std::vector<HandlerPtr> handlers;   // asynchronous handlers to be called.
+
+  Snapshot() {
+    this->prop.init(&this->pkt);
+  }
+};
+
+// release_data() of Snapshot gives back lent packet data after handlers.
+inline void release_data(Snapshot* snapshot) {
+  snapshot->handlers.clear();
+  snapshot->pkt.release();
+}
+
+// AsyncExecutor calls asynchronous handlers on own thread. Snapshots come
+// through a SPSC ring from one Kernel, then a slow handler (e.g. writing to
+// disk) fills the ring instead of stalling decoding.
+
+class AsyncExecutor : public Thread {
  private:
-  HandlerPtr ptr_;
+  RingBuffer<Snapshot> ring_;
+
  public:
-  DeleteHandler(HandlerPtr ptr) : ptr_(ptr) {}
-  bool change(Kernel *kernel);
+  explicit AsyncExecutor(const Config& config) : ring_(config) {}
+  ~AsyncExecutor() = default;
+
+  RingBuffer<Snapshot>& ring() { return this->ring_; }
+  void thread_main();
 };
 
 
+// Kernel decodes packets from one or more packet channel(s). Packets of
+// multiple channels are processed in timestamp order if merge mode is
+// enabled (for offline data sources), or in arrival order otherwise.
+//
+// Handlers are read from HandlerTable by RCU style. Kernel thread loads the
+// current table once per batch (or per PULL_BATCH packets of multiple
+// channels) without lock. When the table has changed, it announces the new
+// one in in_use_ before reading it. A handler change copies the table under
+// table_lock_, publishes the copy and deletes all old tables except the one
+// in in_use_, so at most one old table is kept even while Kernel thread is
+// idle. A handler added while running is called from the next batch.
+//
+// Asynchronous handlers are called by AsyncExecutor that is started by
+// Kernel thread when it is needed first. If the ring to AsyncExecutor is
+// full, Kernel waits (Machine.async_overflow is "block") or skips the
+// asynchronous handlers for the packet and counts it ("drop").
 
 class Kernel : public Thread {
  private:
-  PktChannel pkt_channel_;
-  MsgChannel msg_channel_;
+  // Number of packets taken from a channel at once.
+  static const size_t PULL_BATCH = 64;
+
+  std::vector<PktChannel> pkt_channels_;
   // Channel<Packet> pkt_channel_;
   // Channel<Property> prop_channel_;
   std::shared_ptr<Decoder> dec_;
   uint64_t recv_pkt_;
   uint64_t recv_size_;
-  std::vector< std::vector<HandlerPtr > > handlers_;
-  std::map<hdlr_id, HandlerPtr > handler_map_;
   hdlr_id global_hdlr_id_;
-  std::atomic<bool> running_;
+  size_t worker_;   // index in KernelGroup.
+
+  // Handler table. Members other than table_ and in_use_ are accessed
+  // with table_lock_.
+  std::atomic<HandlerTable*> table_;
+  std::atomic<const HandlerTable*> in_use_;   // nullptr if not running.
+  std::vector<HandlerTable*> retired_;
+  std::map<hdlr_id, HandlerPtr > handler_map_;
+  mutable pthread_mutex_t table_lock_;
+
+  // State to choose next packet from multiple channels.
+  bool merge_;
+  std::vector<Packet*> heads_;   // head packet of each channel for merge.
+  std::vector<size_t> heap_;     // min-heap of channel index by timestamp.
+  size_t last_ch_;               // channel of packet processed last time.
+  size_t rr_idx_;                // channel to be checked first (arrival).
+  Config config_;                    // to create packet channel.
+  Waiter::Strategy wait_strategy_;
+  std::shared_ptr<Waiter> waiter_;   // shared by all packet channels.
+  bool prune_;                       // decode only modules for handlers.
+
+  // State of asynchronous handlers.
+  std::unique_ptr<AsyncExecutor> executor_;
+  bool executor_joined_;
+  bool async_block_;                  // wait for the ring if it is full.
+  std::vector<HandlerPtr> async_hdlrs_;   // handlers of current packet.
+  uint64_t async_drop_;
+
+  Packet* next_packet(size_t* ch_idx);
+  Packet* next_merged(size_t* ch_idx);
+  Packet* next_arrived(size_t* ch_idx);
+  const HandlerTable* pick_table();
+  void publish(HandlerTable* table);
+  void process(Packet* pkt, const HandlerTable* table, Payload* pd,
+               Property* prop);
+  void hand_off(Packet* pkt, Property* prop);
 
  public:
-  Kernel(const Config& config);
+  explicit Kernel(const Config& config, size_t worker = 0);
   ~Kernel();
 
   static void* thread(void* obj);
+  void start();
   void thread_main();
-  HandlerPtr on(const std::string& event_name, Callback&& ev_callback);
+  HandlerPtr on(const std::string& event_name, Callback&& ev_callback,
+                bool async = false);
+  void add(HandlerPtr ptr);
+  void copy_handlers(const Kernel& src);
   bool clear(hdlr_id hid);
   bool clear(HandlerPtr ptr);
 
   bool add_handler(HandlerPtr ptr);
   bool delete_handler(HandlerPtr ptr);
+  // Return IDs of events having handler(s).
+  std::vector<event_id> events() const;
 
   
-  PktChannel pkt_channel() { return this->pkt_channel_; }
+  PktChannel pkt_channel(size_t idx = 0) { return this->pkt_channels_[idx]; }
+  size_t pkt_channel_size() const { return this->pkt_channels_.size(); }
+  // Must be called before start().
+  PktChannel add_pkt_channel();
+  void set_merge(bool merge) { this->merge_ = merge; }
   
   uint64_t recv_pkt()  const { return this->recv_pkt_; }
   uint64_t recv_size() const { return this->recv_size_; }
+  // Number of packets whose asynchronous handlers are skipped.
+  uint64_t async_drop() const { return this->async_drop_; }
 
   const Decoder& dec() const { return *(this->dec_); }
 };
 
+
+// KernelGroup is a set of Kernel(s) that decode packets in parallel. Each
+// kernel has own Decoder (and so own module state such as TCP session table)
+// and all kernels have same handlers. Then callbacks of a handler can be
+// invoked by multiple kernel threads at same time.
+
+class KernelGroup {
+ private:
+  Config config_;
+  std::vector<std::shared_ptr<Kernel> > kernels_;
+
+ public:
+  explicit KernelGroup(const Config& config);
+  ~KernelGroup();
+
+  // Add kernel(s) having handlers of the first kernel. Must be called before
+  // start().
+  void resize(size_t size);
+  size_t size() const { return this->kernels_.size(); }
+  Kernel* at(size_t idx) { return this->kernels_[idx].get(); }
+
+  void start();
+  void join();
+  void stop();
+
+  HandlerPtr on(const std::string& event_name, Callback&& ev_callback,
+                bool async = false);
+  bool clear(HandlerPtr ptr);
+
+  uint64_t recv_pkt()  const;
+  uint64_t recv_size() const;
+  uint64_t async_drop() const;
+
+  const Decoder& dec() const { return this->kernels_[0]->dec(); }
+  std::vector<event_id> events() const { return this->kernels_[0]->events(); }
+};
+
 }   // namespace pm
 
 #endif    // __PACKETMACHINE_KERNEL_HPP__
@@ -25,6 +25,7 @@
  */
 
 #include <assert.h>
+#include <algorithm>
 #include "./module.hpp"
 #include "./decoder.hpp"
 #include "./packetmachine/config.hpp"
@@ -215,8 +216,9 @@ MajorParamDef* Module::define_major_param(const std::string& name,
 }
 
 
-const EventDef* Module::define_event(const std::string& name) {
-  EventDef *def = new EventDef(name);
+const EventDef* Module::define_event(const std::string& name,
+                                     bool stateful) {
+  EventDef *def = new EventDef(name, stateful);
   assert(this->event_map_.find(name) == this->event_map_.end());
   this->event_map_.insert(std::make_pair(name, def));
   return def;
@@ -254,7 +256,11 @@ void Module::define_config(const std::string& name,
 mod_id Module::lookup_module(const std::string& name) {
   // lookup_module must not be called before set decoder.
   assert(this->dec_);
-  return this->dec_->lookup_module(name);
+  mod_id mid = this->dec_->lookup_module(name);
+  if (mid != Module::NONE) {
+    this->next_.push_back(mid);
+  }
+  return mid;
 }
 
 param_id Module::lookup_param_id(const std::string& name) {
@@ -262,6 +268,29 @@ param_id Module::lookup_param_id(const std::string& name) {
   return this->dec_->lookup_param_id(name);
 }
 
+void Module::bind(const std::string& space, uint16_t key) {
+  this->bind_.push_back(std::make_pair(space, key));
+}
+
+const DispatchTable* Module::lookup_dispatch(const std::string& space) {
+  assert(this->dec_);
+  for (auto mid : this->dec_->bound_modules(space)) {
+    if (std::find(this->next_.begin(), this->next_.end(), mid) ==
+        this->next_.end()) {
+      this->next_.push_back(mid);
+    }
+  }
+  return this->dec_->dispatch_table(space);
+}
+
+void Module::extend_filter(const std::string& expr) {
+  if (expr.empty()) {
+    this->filter_.clear();
+  } else if (!this->filter_.empty()) {
+    this->filter_ = "(" + this->filter_ + ") or (" + expr + ")";
+  }
+}
+
 void Module::set_decoder(Decoder* dec) {
   this->dec_ = dec;
 }
@@ -132,9 +132,11 @@ class EventDef {
   event_id id_;
   std::string name_;
   std::string local_name_;
+  bool stateful_;   // event depends on state across packets (e.g. session).
 
  public:
-  explicit EventDef(const std::string& local_name) : local_name_(local_name) {}
+  explicit EventDef(const std::string& local_name, bool stateful = false)
+      : local_name_(local_name), stateful_(stateful) {}
   ~EventDef() {}
   void set_module_id(mod_id id) { this->module_id_ = id; }
   void set_id(param_id id) { this->id_ = id; }
@@ -143,6 +145,7 @@ class EventDef {
   mod_id module_id() const { return this->module_id_; }
   param_id id() const { return this->id_; }
   const std::string& name() const { return this->name_; }
+  bool is_stateful() const { return this->stateful_; }
 };
 
 class ConfigDef {
@@ -164,6 +167,25 @@ class ConfigDef {
   const std::string& local_name() const { return this->local_name_; }
 };
 
+// DispatchTable maps a value of a protocol field (e.g. ethertype, UDP port
+// number) in a key space to the module decoding the payload, so that a
+// module finds the next one by one array load. Modules declare their keys by
+// Module::bind(), and Config can add keys (Machine.dispatch).
+
+class DispatchTable {
+ private:
+  std::vector<int16_t> table_;
+
+ public:
+  DispatchTable() : table_(65536, -1) {}   // -1 is Module::NONE.
+  mod_id lookup(uint16_t key) const { return this->table_[key]; }
+  void set(uint16_t key, mod_id mid) {
+    this->table_[key] = static_cast<int16_t>(mid);
+  }
+};
+
+typedef std::pair<std::string, uint16_t> DispatchKey;
+
 typedef std::map<std::string, ParamDef*> ParamMap;
 typedef std::map<std::string, EventDef*> EventMap;
 typedef std::map<std::string, ConfigDef*> ConfigMap;
@@ -176,6 +198,9 @@ class Module {
   Decoder *dec_;
   mod_id id_;
   std::string name_;
+  std::string filter_;
+  std::vector<mod_id> next_;   // modules looked up by lookup_module().
+  std::vector<DispatchKey> bind_;
 
  protected:
   static Value* new_value();
@@ -190,8 +215,19 @@ class Module {
   void define_config(const std::string& name, int dflt_val);
   void define_config(const std::string& name, bool dflt_val);
   void define_config(const std::string& name, const std::string& dflt_val);
+  // Module looked up is regarded as the next module that decode() can
+  // return, and makes an edge of dispatch graph used to prune decoding.
   mod_id lookup_module(const std::string& name);
   param_id lookup_param_id(const std::string& name);
+  // Declare that packets having key in space (e.g. "ethertype" 0x0800 or
+  // "udp.port" 53) are decoded by this module. Called in constructor.
+  void bind(const std::string& space, uint16_t key);
+  // Return table of space for decode(). All modules bound to the space are
+  // regarded as next modules as with lookup_module().
+  const DispatchTable* lookup_dispatch(const std::string& space);
+  // BPF expression matching all packets that can reach the module. Module
+  // without filter (e.g. Ethernet) can not be used to narrow packets.
+  void define_filter(const std::string& expr) { this->filter_ = expr; }
 
  public:
   static const mod_id NONE = -1;
@@ -203,8 +239,15 @@ class Module {
 
   mod_id id() const { return this->id_; }
   const std::string& name() const { return this->name_; }
-
-  const EventDef* define_event(const std::string& name);
+  const std::string& filter() const { return this->filter_; }
+  const std::vector<mod_id>& next_modules() const { return this->next_; }
+  const std::vector<DispatchKey>& bindings() const { return this->bind_; }
+  // Add expr to filter by "or" for a key added by Config. Empty expr means
+  // the key can not be expressed, then the module can not narrow packets.
+  void extend_filter(const std::string& expr);
+
+  const EventDef* define_event(const std::string& name,
+                               bool stateful = false);
 
   ParamMap* param_map() { return &(this->param_map_); }
   EventMap* event_map() { return &(this->event_map_); }
@@ -68,6 +68,8 @@ class ARP : public Module {
 
  public:
   ARP() {
+    this->define_filter("arp");
+    this->bind("ethertype", 0x0806);
     this->p_hw_type_ = this->define_param("hw_type");
     this->p_pr_type_ = this->define_param("pr_type");
     this->p_hw_size_ = this->define_param("hw_size");
@@ -109,6 +109,9 @@ class DHCP : public Module {
 
  public:
   DHCP() {
+    this->define_filter("udp port 67 or udp port 68");
+    this->bind("udp.port", 67);
+    this->bind("udp.port", 68);
     this->p_msg_type_         = this->define_param("msg_type");
     this->p_hw_type_          = this->define_param("hw_type");
     this->p_hw_addr_len_      = this->define_param("hw_addr_len");
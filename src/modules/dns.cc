@@ -31,6 +31,8 @@ namespace pm {
 class DNS : public NameService {
  public:
   DNS() : NameService("DNS") {
+    this->define_filter("udp port 53");
+    this->bind("udp.port", 53);
   }
   ~DNS() = default;
 };
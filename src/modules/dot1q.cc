@@ -41,18 +41,18 @@ class Dot1Q : public Module {
   } __attribute__((packed));
 
   const ParamDef *p_vlan_id_, *p_type_;
-  mod_id mod_ipv4_, mod_arp_, mod_pppoe_;
+  const DispatchTable* ethertype_;
 
  public:
   Dot1Q() {
+    this->define_filter("ether proto 0x8100");
+    this->bind("ethertype", 0x8100);
     this->p_type_    = this->define_param("type");
     this->p_vlan_id_ = this->define_param("vlan_id");
   }
 
   void setup(const Config& config) {
-    this->mod_ipv4_  = this->lookup_module("IPv4");
-    this->mod_arp_   = this->lookup_module("ARP");
-    this->mod_pppoe_ = this->lookup_module("PPPoE");
+    this->ethertype_ = this->lookup_dispatch("ethertype");
   }
 
   mod_id decode(Payload* pd, Property* prop) {
@@ -67,14 +67,7 @@ class Dot1Q : public Module {
     prop->retain_value(this->p_vlan_id_)->cpy(&vlan_id, sizeof(vlan_id),
                                               Value::LITTLE);
 
-    mod_id next = Module::NONE;
-    switch (ntohs(hdr->type_)) {
-      case ETHERTYPE_ARP: next = this->mod_arp_; break;
-      case ETHERTYPE_IP:  next = this->mod_ipv4_; break;
-      case ETHERTYPE_PPPOE_SSN: next = this->mod_pppoe_; break;
-    }
-
-    return next;
+    return this->ethertype_->lookup(ntohs(hdr->type_));
   }
 };
 
@@ -71,7 +71,7 @@ class Ethernet : public Module {
   } __attribute__((packed));
 
   const ParamDef *p_type_, *p_src_, *p_dst_;
-  mod_id mod_ipv4_, mod_arp_, mod_pppoe_, mod_dot1q_;
+  const DispatchTable* ethertype_;
 
  public:
   Ethernet() {
@@ -84,10 +84,7 @@ class Ethernet : public Module {
   }
 
   void setup(const Config& config) {
-    this->mod_ipv4_ = this->lookup_module("IPv4");
-    this->mod_arp_  = this->lookup_module("ARP");
-    this->mod_pppoe_ = this->lookup_module("PPPoE");
-    this->mod_dot1q_ = this->lookup_module("Dot1Q");
+    this->ethertype_ = this->lookup_dispatch("ethertype");
   }
 
   mod_id decode(Payload* pd, Property* prop) {
@@ -97,19 +94,11 @@ class Ethernet : public Module {
       return Module::NONE;
     }
 
-    prop->retain_value(this->p_type_)->set(&hdr->type_, sizeof(hdr->type_));
-    prop->retain_value(this->p_src_)->set(&hdr->src_, sizeof(hdr->src_));
-    prop->retain_value(this->p_dst_)->set(&hdr->dst_, sizeof(hdr->dst_));
+    prop->set_value(this->p_type_, &hdr->type_, sizeof(hdr->type_));
+    prop->set_value(this->p_src_, &hdr->src_, sizeof(hdr->src_));
+    prop->set_value(this->p_dst_, &hdr->dst_, sizeof(hdr->dst_));
 
-    mod_id next = Module::NONE;
-    switch (ntohs(hdr->type_)) {
-      case ETHERTYPE_ARP: next = this->mod_arp_; break;
-      case ETHERTYPE_IP:  next = this->mod_ipv4_; break;
-      case ETHERTYPE_802_1Q: next = this->mod_dot1q_; break;
-      case ETHERTYPE_PPPOE_SSN: next = this->mod_pppoe_; break;
-    }
-
-    return next;
+    return this->ethertype_->lookup(ntohs(hdr->type_));
   }
 };
 
@@ -128,6 +128,8 @@ class ICMP : public Module {
 
  public:
   ICMP() {
+    this->define_filter("icmp");
+    this->bind("ip.proto", 1);
     this->p_type_   = this->define_param("type", IcmpType::new_value);
     this->p_code_   = this->define_param("code", IcmpCode::new_value);
     this->p_chksum_ = this->define_param("chksum");
@@ -59,10 +59,13 @@ class IPv4 : public Module {
   const ParamDef* p_dst_;
   const ParamDef* p_opt_;
   const ParamDef* p_data_;
-  mod_id mod_tcp_, mod_udp_, mod_icmp_;
+  const DispatchTable* ip_proto_;
 
  public:
   IPv4() {
+    this->define_filter("ip");
+    this->bind("ethertype", 0x0800);
+    this->bind("ppp.proto", 0x0021);
 
 #define DEFINE_HDR(NAME)                                                \
     this->p_hdr_->define_minor(                                         \
@@ -108,13 +111,11 @@ class IPv4 : public Module {
   }
 
   void setup(const Config& config) {
-    this->mod_tcp_  = this->lookup_module("TCP");
-    this->mod_udp_  = this->lookup_module("UDP");
-    this->mod_icmp_ = this->lookup_module("ICMP");
+    this->ip_proto_ = this->lookup_dispatch("ip.proto");
   }
 
 #define SET_PROP(PARAM, DATA) \
-  prop->retain_value(PARAM)->set(&(DATA), sizeof(DATA));
+  prop->set_value(PARAM, &(DATA), sizeof(DATA));
 
   mod_id decode(Payload* pd, Property* prop) {
     auto hdr = reinterpret_cast<const struct ipv4_header*>
@@ -131,7 +132,7 @@ class IPv4 : public Module {
       return Module::NONE;
     }
 
-    prop->retain_value(this->p_hdr_)->set(hdr, sizeof(struct ipv4_header));
+    prop->set_value(this->p_hdr_, hdr, sizeof(struct ipv4_header));
     
     assert(total_len >= hdr_len);
     uint16_t data_len = total_len - hdr_len;
@@ -146,22 +147,14 @@ class IPv4 : public Module {
     if (hdrlen > sizeof(struct ipv4_header)) {
       const size_t opt_len = hdrlen - sizeof(struct ipv4_header);
       auto opt = pd->retain(opt_len);
-      prop->retain_value(this->p_opt_)->set(opt, opt_len);
+      prop->set_value(this->p_opt_, opt, opt_len);
     }
 
     // Adjust payload length
     pd->shrink(data_len);
-    prop->retain_value(this->p_data_)->set(pd->ptr(), pd->length());
+    prop->set_value(this->p_data_, pd->ptr(), pd->length());
 
-    mod_id next = Module::NONE;
-
-    switch (hdr->proto_) {
-      case PROTO_ICMP: next = this->mod_icmp_; break;
-      case PROTO_TCP:  next = this->mod_tcp_; break;
-      case PROTO_UDP:  next = this->mod_udp_; break;
-    }
-
-    return next;
+    return this->ip_proto_->lookup(hdr->proto_);
   }
 };
 
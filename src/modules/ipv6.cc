@@ -58,11 +58,14 @@ class IPv6 : public Module {
   // const ParamDef* p_dst_;
   const ParamDef* p_opt_;
   const ParamDef* p_data_;
-  mod_id mod_tcp_, mod_udp_;
+  const DispatchTable* ip_proto_;
   // mod_id mod_icmp6_;
 
  public:
   IPv6() {
+    this->define_filter("ip6");
+    this->bind("ethertype", 0x86dd);
+    this->bind("ppp.proto", 0x0057);
 
 #define DEFINE_HDR(NAME)                                                \
     this->p_hdr_->define_minor(                                         \
@@ -114,8 +117,7 @@ class IPv6 : public Module {
   }
 
   void setup(const Config& config) {
-    this->mod_tcp_  = this->lookup_module("TCP");
-    this->mod_udp_  = this->lookup_module("UDP");
+    this->ip_proto_ = this->lookup_dispatch("ip.proto");
   }
 
   mod_id decode(Payload* pd, Property* prop) {
@@ -133,14 +135,7 @@ class IPv6 : public Module {
     prop->retain(this->p_dst_)->set(hdr->dst_, sizeof(hdr->dst_));
     */
 
-    mod_id next = Module::NONE;
-
-    switch (hdr->next_hdr_) {
-      case PROTO_TCP:  next = this->mod_tcp_; break;
-      case PROTO_UDP:  next = this->mod_udp_; break;
-    }
-
-    return next;
+    return this->ip_proto_->lookup(hdr->next_hdr_);
   }
 };
 
@@ -31,6 +31,8 @@ namespace pm {
 class MDNS : public NameService {
  public:
   MDNS() : NameService("MDNS") {
+    this->define_filter("udp port 5353");
+    this->bind("udp.port", 5353);
   }
   ~MDNS() = default;
 };
@@ -44,10 +44,12 @@ class PPPoE : public Module {
   const ParamDef* p_code_;
   const ParamDef* p_session_id_;
   const ParamDef* p_payload_length_;
-  mod_id mod_ipv4_;
+  const DispatchTable* ppp_proto_;
 
  public:
   PPPoE() {
+    this->define_filter("ether proto 0x8864");
+    this->bind("ethertype", 0x8864);   // PPPoE session stage
     this->p_version_         = this->define_param("version");
     this->p_type_            = this->define_param("type");
     this->p_code_            = this->define_param("code");
@@ -59,7 +61,7 @@ class PPPoE : public Module {
   }
 
   void setup(const Config& config) {
-    this->mod_ipv4_ = this->lookup_module("IPv4");
+    this->ppp_proto_ = this->lookup_dispatch("ppp.proto");
   }
 
   mod_id decode(Payload* pd, Property* prop) {
@@ -82,17 +84,12 @@ class PPPoE : public Module {
     SET_VAL(this->p_session_id_,     hdr->session_id_);
     SET_VAL(this->p_payload_length_, hdr->payload_length_);
 
-    mod_id next = Module::NONE;
     auto ppp = reinterpret_cast<const uint16_t*>(pd->retain(2));
     if (ppp == nullptr) {   // Not enough packet size.
       return Module::NONE;
     }
 
-    if (ntohs(*ppp) == 0x21) {   // IPv4
-      next = this->mod_ipv4_;
-    }
-
-    return next;
+    return this->ppp_proto_->lookup(ntohs(*ppp));
   }
 };
 
@@ -26,6 +26,7 @@
 
 #include <string.h>
 #include <arpa/inet.h>
+#include <algorithm>
 #include "../module.hpp"
 #include "../../external/cpp-toolbox/src/cache.hpp"
 #include "../../external/cpp-toolbox/src/buffer.hpp"
@@ -93,8 +94,10 @@ class TCP : public Module {
   time_t curr_ts_;
   bool init_ts_;
   tb::LruHash<Session*>* ssn_table_;
+  const DispatchTable* tcp_port_;
   bool enable_ssn_mgmt_;
   time_t ssn_timeout_;
+  tb::HashKey ssn_key_;   // work area, one per decoder (worker).
 
   class Session {
    public:
@@ -459,6 +462,8 @@ class TCP : public Module {
 
  public:
   TCP() : ssn_count_(0), curr_ts_(0), init_ts_(false), ssn_table_(nullptr) {
+    this->define_filter("tcp");
+    this->bind("ip.proto", 6);
     // -------------------------------
     // Define parameters    
     this->p_src_port_ = this->define_param("src_port",
@@ -525,9 +530,9 @@ class TCP : public Module {
 
     // -------------------------------
     // Define events
-    this->ev_new_ = this->define_event("new_session");
-    this->ev_estb_ = this->define_event("established");
-    this->ev_close_ = this->define_event("closed");
+    this->ev_new_ = this->define_event("new_session", true);
+    this->ev_estb_ = this->define_event("established", true);
+    this->ev_close_ = this->define_event("closed", true);
     
     // -------------------------------
     // Define configs
@@ -550,6 +555,7 @@ class TCP : public Module {
     size_t ssn_table_size =
         static_cast<size_t>(config.get("session_table_size").as_int());
     this->ssn_table_ = new tb::LruHash<Session*>(3600, ssn_table_size);
+    this->tcp_port_ = this->lookup_dispatch("tcp.port");
     
     this->enable_ssn_mgmt_ = config.get("enable_session_mgmt").as_bool();
 
@@ -577,12 +583,12 @@ class TCP : public Module {
     // TCP port number
     prop->set_src_port(ntohs(hdr->src_port_));
     prop->set_dst_port(ntohs(hdr->dst_port_));
-    prop->retain_value(this->p_src_port_)->set(&(hdr->src_port_),
-                                               sizeof(hdr->src_port_));
-    prop->retain_value(this->p_dst_port_)->set(&(hdr->dst_port_),
-                                               sizeof(hdr->dst_port_));
+    prop->set_value(this->p_src_port_, &(hdr->src_port_),
+                    sizeof(hdr->src_port_));
+    prop->set_value(this->p_dst_port_, &(hdr->dst_port_),
+                    sizeof(hdr->dst_port_));
 
-    prop->retain_value(this->p_hdr_)->set(hdr, sizeof(struct tcp_header));
+    prop->set_value(this->p_hdr_, hdr, sizeof(struct tcp_header));
     
     // Set option data.
     const uint8_t offset = (hdr->offset_ & 0xf0) >> 2;
@@ -593,7 +599,7 @@ class TCP : public Module {
         return false;
       }
 
-      prop->retain_value(this->p_optdata_)->set(opt, optlen);
+      prop->set_value(this->p_optdata_, opt, optlen);
     }
 
     return true;
@@ -635,17 +641,15 @@ class TCP : public Module {
     const size_t seg_len = pd->length();
     const byte_t* seg_ptr = nullptr;
 
-    // Set segment data.
+    // Set segment data. Payload is left for the next module.
     if (seg_len > 0) {
-      seg_ptr = pd->retain(seg_len);
-      prop->retain_value(this->p_segment_)->set(seg_ptr, seg_len);
+      seg_ptr = pd->ptr();
+      prop->set_value(this->p_segment_, seg_ptr, seg_len);
     }
 
     // ----------------------------------------
     // TCP session management
     if (this->enable_ssn_mgmt_) {
-      static tb::HashKey key;
-
       time_t ts = prop->ts();
       if (this->curr_ts_ < ts) {
         time_t diff = ts - this->curr_ts_;
@@ -663,8 +667,9 @@ class TCP : public Module {
       }
 
 
-      Session::make_key(*prop, &key);
-      Session* ssn = this->search_session(prop, this->ssn_table_, key, this);
+      Session::make_key(*prop, &this->ssn_key_);
+      Session* ssn = this->search_session(prop, this->ssn_table_,
+                                          this->ssn_key_, this);
     
       if (ssn) {
         uint8_t flags = (hdr->flags_ & (FIN | SYN | RST | ACK));
@@ -679,8 +684,16 @@ class TCP : public Module {
         ssn->decode(prop, flags, seq, ack, seg_len, seg_ptr, win);
       }
     }
-    
-    return Module::NONE;
+
+    // Server port is usually smaller than client (ephemeral) one.
+    const uint16_t sport = ntohs(hdr->src_port_);
+    const uint16_t dport = ntohs(hdr->dst_port_);
+    mod_id next = this->tcp_port_->lookup(std::min(sport, dport));
+    if (next == Module::NONE) {
+      next = this->tcp_port_->lookup(std::max(sport, dport));
+    }
+
+    return next;
   }
 };
 
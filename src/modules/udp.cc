@@ -25,6 +25,7 @@
  */
 
 #include <arpa/inet.h>
+#include <algorithm>
 #include "../module.hpp"
 #include "../debug.hpp"
 
@@ -46,12 +47,12 @@ class UDP : public Module {
   const ParamDef* p_chksum_;
   MajorParamDef* p_hdr_;
 
-  mod_id mod_dns_;
-  mod_id mod_mdns_;
-  mod_id mod_dhcp_;
+  const DispatchTable* udp_port_;
 
  public:
   UDP() {
+    this->define_filter("udp");
+    this->bind("ip.proto", 17);
     this->p_src_port_ = this->define_param("src_port",
                                            value::PortNumber::new_value);
     this->p_dst_port_ = this->define_param("dst_port",
@@ -75,13 +76,11 @@ class UDP : public Module {
   }
 
   void setup(const Config& config) {
-    this->mod_dns_  = this->lookup_module("DNS");
-    this->mod_mdns_ = this->lookup_module("MDNS");
-    this->mod_dhcp_ = this->lookup_module("DHCP");
+    this->udp_port_ = this->lookup_dispatch("udp.port");
   }
 
 #define SET_PROP(PARAM, DATA) \
-  prop->retain_value(PARAM)->set(&(DATA), sizeof(DATA));
+  prop->set_value(PARAM, &(DATA), sizeof(DATA));
 
   mod_id decode(Payload* pd, Property* prop) {
     auto hdr = reinterpret_cast<const struct udp_header*>
@@ -92,22 +91,18 @@ class UDP : public Module {
 
     prop->set_src_port(ntohs(hdr->src_port_));
     prop->set_dst_port(ntohs(hdr->dst_port_));
-    prop->retain_value(this->p_hdr_)->set(hdr, sizeof(struct udp_header));
+    prop->set_value(this->p_hdr_, hdr, sizeof(struct udp_header));
     SET_PROP(this->p_src_port_, hdr->src_port_);
     SET_PROP(this->p_dst_port_, hdr->dst_port_);
     SET_PROP(this->p_length_,   hdr->length_);
     SET_PROP(this->p_chksum_,   hdr->chksum_);
 
-    mod_id next = Module::NONE;
+    // Server port is usually smaller than client (ephemeral) one.
     uint16_t sport = ntohs(hdr->src_port_);
     uint16_t dport = ntohs(hdr->dst_port_);
-
-    if (sport == 53 || dport == 53) {
-      next = this->mod_dns_;
-    } else if (sport == 5353 || dport == 5353) {
-      next = this->mod_mdns_;
-    } else if (sport == 67 || sport == 68 || dport == 67 || dport == 68) {
-      next = this->mod_dhcp_;
+    mod_id next = this->udp_port_->lookup(std::min(sport, dport));
+    if (next == Module::NONE) {
+      next = this->udp_port_->lookup(std::max(sport, dport));
     }
 
     return next;
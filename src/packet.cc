@@ -27,39 +27,86 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <utility>
 
 #include "./packet.hpp"
 #include "./debug.hpp"
 
 namespace pm {
 
-Packet::Packet() : buf_len_(0), buf_(nullptr) {
+Packet::Packet() : len_(0), buf_len_(0), buf_(nullptr), own_buf_(false),
+                   data_(nullptr), lender_(nullptr), tag_(0) {
 }
 
 Packet::~Packet() {
-  if (this->buf_) {
+  if (this->buf_ && this->own_buf_) {
     ::free(this->buf_);
   }
 }
 
 bool Packet::store(const byte_t* data, uint64_t len) {
+  this->release();
+
   if (this->buf_ == nullptr || this->buf_len_ < len) {
-    // need memory allocation.
-    this->buf_ = reinterpret_cast<byte_t*>(::realloc(this->buf_, len));
+    // need memory allocation. Given buffer can not be reallocated.
+    void* buf = this->own_buf_ ? ::realloc(this->buf_, len) : ::malloc(len);
 
-    if (this->buf_ == nullptr) {
+    if (buf == nullptr) {
       // memory allocation error.
       return false;
     }
 
+    this->buf_ = reinterpret_cast<byte_t*>(buf);
+    this->own_buf_ = true;
     this->buf_len_ = len;
   }
 
   ::memcpy(this->buf_, data, len);
+  this->data_ = this->buf_;
   this->len_ = len;
   return true;
 }
 
+void Packet::lend(const byte_t* data, uint64_t len, PacketLender* lender,
+                  uint64_t tag) {
+  this->release();
+
+  this->data_ = data;
+  this->len_ = len;
+  this->lender_ = lender;
+  this->tag_ = tag;
+}
+
+void Packet::release() {
+  if (this->lender_) {
+    PacketLender* lender = this->lender_;
+    this->lender_ = nullptr;
+    this->data_ = nullptr;
+    lender->give_back(this);
+  }
+}
+
+void Packet::set_buffer(byte_t* buf, uint64_t len) {
+  if (this->buf_ && this->own_buf_) {
+    ::free(this->buf_);
+  }
+  this->buf_ = buf;
+  this->buf_len_ = len;
+  this->own_buf_ = false;
+}
+
+void Packet::swap(Packet* pkt) {
+  std::swap(this->len_, pkt->len_);
+  std::swap(this->cap_len_, pkt->cap_len_);
+  std::swap(this->buf_len_, pkt->buf_len_);
+  std::swap(this->buf_, pkt->buf_);
+  std::swap(this->own_buf_, pkt->own_buf_);
+  std::swap(this->data_, pkt->data_);
+  std::swap(this->lender_, pkt->lender_);
+  std::swap(this->tag_, pkt->tag_);
+  std::swap(this->tv_, pkt->tv_);
+}
+
 void Packet::set_cap_len(unsigned int cap_len) {
   this->cap_len_ = static_cast<uint64_t>(cap_len);
 }
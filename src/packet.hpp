@@ -32,8 +32,35 @@
 
 namespace pm {
 
+class Packet;
+
+// PacketLender is a data source that lends own buffer to Packet instead of
+// copying packet data into Packet. give_back() is called when the consumer
+// of Packet finished to use the data.
+
+class PacketLender {
+ public:
+  PacketLender() = default;
+  virtual ~PacketLender() = default;
+  virtual void give_back(const Packet* pkt) = 0;
+};
+
 // Packet is to store captured packet data(raw data, captured length,
 // actual packet length, timestamp).
+//
+// Packet has 2 ways to hold data. store() copies data into own buffer and
+// lend() just refers buffer of PacketLender without copy. Lent data must be
+// given back by release() after use. Destructor does not give it back because
+// the lender may be already deleted at that time.
+//
+// Buffer of store() can be given by set_buffer() (e.g. a block of slab owned
+// by RingBuffer). If data is larger than the buffer, Packet allocates own
+// buffer instead.
+//
+// swap() exchanges whole contents including buffers with another Packet in
+// order to move a packet between rings without copy. A buffer given by
+// set_buffer() may move to another Packet by swap(), then it must be valid
+// while any of them is used.
 
 class Packet {
  private:
@@ -41,6 +68,10 @@ class Packet {
   uint64_t cap_len_;   // length this packet.
   uint64_t buf_len_;   // allocated buffer length.
   byte_t *buf_;        // buffer memory pointer.
+  bool own_buf_;       // buf_ is allocated by Packet and to be freed.
+  const byte_t *data_;     // pointer of packet data, buf_ or lent buffer.
+  PacketLender* lender_;   // not nullptr while data is lent.
+  uint64_t tag_;           // lender's own data to identify lent buffer.
   struct timeval tv_;  // timestamp of packet arrived.
 
  public:
@@ -48,16 +79,34 @@ class Packet {
   ~Packet();
 
   bool store(const byte_t* data, uint64_t len);
+  void lend(const byte_t* data, uint64_t len, PacketLender* lender,
+            uint64_t tag = 0);
+  void release();
+  void set_buffer(byte_t* buf, uint64_t len);
+  void swap(Packet* pkt);
   void set_cap_len(unsigned int cap_len_);
   void set_tv(const timeval& tv);
 
   uint64_t len() const { return this->len_; }
   uint64_t cap_len() const { return this->cap_len_; }
-  const byte_t* buf() const { return this->buf_; }
+  const byte_t* buf() const { return this->data_; }
   uint64_t buf_len() const { return this->buf_len_; }
   const timeval& tv() const { return this->tv_; }
+  bool is_lent() const { return (this->lender_ != nullptr); }
+  uint64_t tag() const { return this->tag_; }
 };
 
+// release_data() is called by RingBuffer::release() in order to give back
+// lent data when the consumer finished to process Packet.
+inline void release_data(Packet* pkt) {
+  pkt->release();
+}
+
+// init_slot() is called by RingBuffer to give slab memory to a slot.
+inline void init_slot(Packet* pkt, byte_t* buf, size_t len) {
+  pkt->set_buffer(buf, len);
+}
+
 }   // namespace pm
 
 #endif   // __PACKETMACHINE_PACKET_HPP__
@@ -25,46 +25,264 @@
  */
 
 #include <unistd.h>
+#include <sched.h>
+#include <stdio.h>
+#include <algorithm>
 #include <assert.h>
 #include <sys/time.h>
 #include <time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 #include "./packetmachine.hpp"
 #include "./capture.hpp"
 #include "./packet.hpp"
 #include "./channel.hpp"
 #include "./kernel.hpp"
 #include "./thread.hpp"
+#include "./flow.hpp"
 
 #include "./debug.hpp"
 
 namespace pm {
 
+// Input reads packets from a data source and pushes them to the ring of
+// Kernel. If the ring is full, it waits for Kernel (BLOCK) or reads and drops
+// packets by itself (DROP and SAMPLE) so that drops are counted. With SAMPLE,
+// only 1 of sample_rate packets is pushed while the ring is half full or more.
+
 class Input : public Thread {
+ public:
+  enum DropPolicy {
+    BLOCK,
+    DROP,
+    SAMPLE,
+  };
+
  private:
+  static const size_t BATCH_SIZE = 64;
+  // Upper bound of blocking in case of a missed wakeup.
+  static const int WAIT_TIMEOUT_MS = 100;
   Capture* cap_;
-  PktChannel channel_;
+  std::vector<PktChannel> channels_;   // one per Kernel, sharded by flow.
+  PktChannel channel_;                 // first of channels_.
+  int fd_;          // selectable fd of the data source, or -1 to poll read().
+  int epfd_;
+  int busy_poll_;   // number of empty reads before blocking on fd_.
+  DropPolicy policy_;
+  uint32_t sample_rate_;
+  uint64_t sample_seq_;
+  std::atomic<uint64_t> drop_pkt_;
+  // Packets to be dropped when ring is full, or staging packets to be
+  // routed to channels_ by flow.
+  Packet scratch_[BATCH_SIZE];
+
+  void wait() {
+#ifdef __linux__
+    struct epoll_event ev;
+    ::epoll_wait(this->epfd_, &ev, 1, WAIT_TIMEOUT_MS);
+#else
+    struct pollfd pfd;
+    pfd.fd = this->fd_;
+    pfd.events = POLLIN;
+    ::poll(&pfd, 1, WAIT_TIMEOUT_MS);
+#endif
+  }
 
  public:
-  Input(Capture* cap, PktChannel channel) :
-      cap_(cap), channel_(channel) {
+  Input(Capture* cap, const std::vector<PktChannel>& channels, int fd = -1,
+        int busy_poll = 0, DropPolicy policy = BLOCK, int sample_rate = 1) :
+      cap_(cap), channels_(channels), channel_(channels[0]), fd_(fd),
+      epfd_(-1), busy_poll_(busy_poll), policy_(policy),
+      sample_rate_(sample_rate), sample_seq_(0), drop_pkt_(0) {
+#ifdef __linux__
+    if (this->fd_ >= 0) {
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.fd = this->fd_;
+      this->epfd_ = ::epoll_create1(0);
+      if (this->epfd_ < 0 ||
+          ::epoll_ctl(this->epfd_, EPOLL_CTL_ADD, this->fd_, &ev) != 0) {
+        // Fall back to polling read().
+        this->fd_ = -1;
+      }
+    }
+#endif
   }
   ~Input() {
+    if (this->epfd_ >= 0) {
+      ::close(this->epfd_);
+    }
   }
 
-  void thread_main() {
-    Packet *pkt;
-    Capture::Result rc;
+  // Convert name of Machine.drop_policy. Return false if unknown.
+  static bool parse_policy(const std::string& name, DropPolicy* policy) {
+    if (name == "block") {
+      *policy = BLOCK;
+    } else if (name == "drop") {
+      *policy = DROP;
+    } else if (name == "sample") {
+      *policy = SAMPLE;
+    } else {
+      return false;
+    }
+    return true;
+  }
 
-    for (;;) {
-      pkt = this->channel_->retain();
+  uint64_t drop_pkt() const { return this->drop_pkt_; }
+
+  // Drop packets other than 1 of sample_rate_ and move kept packets to the
+  // head of pkts. Return number of kept packets.
+  size_t sample(Packet** pkts, size_t count) {
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (this->sample_seq_++ % this->sample_rate_ == 0) {
+        std::swap(pkts[kept], pkts[i]);
+        kept++;
+      } else {
+        pkts[i]->release();
+      }
+    }
+    this->drop_pkt_.fetch_add(count - kept, std::memory_order_relaxed);
+    return kept;
+  }
 
-      while (Capture::NONE == (rc = this->cap_->read(pkt))) {
+  // Read packets into pkts. Wait while no packet is available.
+  Capture::Result read_batch(Packet** pkts, size_t n, size_t* count) {
+    Capture::Result rc;
+    int empty = 0;
+    while (Capture::NONE == (rc = this->cap_->read_batch(pkts, n, count))) {
+      if (this->fd_ < 0) {
         // timeout read packet data.
         usleep(1);
+      } else if (empty < this->busy_poll_) {
+        empty++;
+      } else {
+        this->wait();
+        empty = 0;
+      }
+    }
+    return rc;
+  }
+
+  // Move packets into ring slots of channel by Packet::swap(). Packets that
+  // can not be put into the ring by drop policy are dropped.
+  void deliver(const PktChannel& channel, Packet** pkts, size_t count) {
+    if (this->policy_ == SAMPLE &&
+        channel->used_size() >= channel->ring_size() / 2) {
+      count = this->sample(pkts, count);
+    }
+
+    Packet *slots[BATCH_SIZE];
+    size_t done = 0;
+    while (done < count) {
+      size_t n = (this->policy_ == BLOCK ?
+                  channel->retain_batch(slots, count - done) :
+                  channel->try_retain_batch(slots, count - done));
+      if (n == 0) {
+        for (size_t i = done; i < count; i++) {
+          pkts[i]->release();
+        }
+        this->drop_pkt_.fetch_add(count - done, std::memory_order_relaxed);
+        break;
       }
 
-      if (rc == Capture::OK) {
-        this->channel_->push(pkt);
+      for (size_t i = 0; i < n; i++) {
+        slots[i]->swap(pkts[done + i]);
+      }
+      channel->push_batch(slots, n);
+      done += n;
+    }
+  }
+
+  // Route packets to channels_ by symmetric flow hash, then all packets of a
+  // flow (both directions) are decoded by one Kernel in order.
+  void shard_main() {
+    const size_t n_ch = this->channels_.size();
+    Packet *pkts[BATCH_SIZE];
+    std::vector<std::vector<Packet*> > shards(n_ch);
+    size_t count;
+
+    for (size_t i = 0; i < BATCH_SIZE; i++) {
+      pkts[i] = &this->scratch_[i];
+    }
+    for (auto& shard : shards) {
+      shard.reserve(BATCH_SIZE);
+    }
+
+    for (;;) {
+      Capture::Result rc = this->read_batch(pkts, BATCH_SIZE, &count);
+      if (rc != Capture::OK) {
+        for (auto& ch : this->channels_) {
+          ch->close();
+        }
+
+        if (rc == Capture::ERROR) {
+          throw Exception::RunTimeError(this->cap_->error());
+        }
+        break;
+      }
+
+      for (size_t i = 0; i < count; i++) {
+        uint32_t h = flow_hash(pkts[i]->buf(), pkts[i]->len());
+        shards[h % n_ch].push_back(pkts[i]);
+      }
+      for (size_t k = 0; k < n_ch; k++) {
+        if (!shards[k].empty()) {
+          this->deliver(this->channels_[k], shards[k].data(),
+                        shards[k].size());
+          shards[k].clear();
+        }
+      }
+    }
+  }
+
+  void thread_main() {
+    if (this->channels_.size() > 1) {
+      this->shard_main();
+      return;
+    }
+
+    Packet *pkts[BATCH_SIZE];
+    Packet *scratch[BATCH_SIZE];
+    Capture::Result rc;
+    size_t n, count;
+
+    for (size_t i = 0; i < BATCH_SIZE; i++) {
+      scratch[i] = &this->scratch_[i];
+    }
+    const uint32_t half = this->channel_->ring_size() / 2;
+
+    for (;;) {
+      // Reserve and publish ring slots per batch, not per packet.
+      Packet** dst = pkts;
+      bool sampling = false;
+      if (this->policy_ == BLOCK) {
+        n = this->channel_->retain_batch(pkts, BATCH_SIZE);
+      } else {
+        n = this->channel_->try_retain_batch(pkts, BATCH_SIZE);
+        if (n == 0) {
+          // Ring is full. Read packets to drop them.
+          dst = scratch;
+          n = BATCH_SIZE;
+        } else if (this->policy_ == SAMPLE) {
+          sampling = (this->channel_->used_size() >= half);
+        }
+      }
+
+      rc = this->read_batch(dst, n, &count);
+
+      if (rc == Capture::OK && dst == scratch) {
+        for (size_t i = 0; i < count; i++) {
+          scratch[i]->release();
+        }
+        this->drop_pkt_.fetch_add(count, std::memory_order_relaxed);
+      } else if (rc == Capture::OK && sampling) {
+        this->channel_->push_batch(pkts, this->sample(pkts, count), n);
+      } else if (rc == Capture::OK) {
+        this->channel_->push_batch(pkts, count);
       } else {
         this->channel_->close();
 
@@ -80,7 +298,7 @@ class Input : public Thread {
 
 
 Handler::Handler(std::shared_ptr<HandlerEntity> ptr,
-                 std::shared_ptr<Kernel> kernel) :
+                 std::shared_ptr<KernelGroup> kernel) :
     ptr_(ptr), kernel_(kernel) {  
 }
     
@@ -123,56 +341,296 @@ bool Handler::destroy() {
 
 
 Machine::Machine() :
-    cap_(nullptr), input_(nullptr) {
+    workers_(1), file_workers_(1), auto_filter_(false), event_wait_(false),
+    busy_poll_(0), drop_policy_("block"), sample_rate_(10), rt_priority_(0) {
   Config config;
-  this->kernel_ = std::shared_ptr<Kernel>(new Kernel(config));
+  this->setup(config);
+  this->kernel_ = std::shared_ptr<KernelGroup>(
+      new KernelGroup(this->kernel_config(config)));
 }
 
 Machine::Machine(const Config& config) :
-    cap_(nullptr), input_(nullptr) {
-  this->kernel_ = std::shared_ptr<Kernel>(new Kernel(config));
+    workers_(1), file_workers_(1), auto_filter_(false), event_wait_(false),
+    busy_poll_(0), drop_policy_("block"), sample_rate_(10), rt_priority_(0) {
+  this->setup(config);
+  this->kernel_ = std::shared_ptr<KernelGroup>(
+      new KernelGroup(this->kernel_config(config)));
 }
 
 Machine::~Machine() {
-  delete this->cap_;
-  delete this->input_;
+  for (auto cap : this->caps_) {
+    delete cap;
+  }
+  for (auto input : this->inputs_) {
+    delete input;
+  }
 }
 
-void Machine::add_pcapdev(const std::string &dev_name) {
-  if (this->cap_) {
-    throw Exception::ConfigError("data source has been configured");
+// Parse CPU list of key, e.g. "0,2,4-7".
+static std::vector<int> parse_cpus(const std::string& key,
+                                   const std::string& val) {
+  const long n_cpu = ::sysconf(_SC_NPROCESSORS_CONF);  // NOLINT
+  std::vector<int> cpus;
+  size_t pos = 0;
+  while (pos <= val.size()) {
+    size_t end = val.find(',', pos);
+    if (end == std::string::npos) {
+      end = val.size();
+    }
+    const std::string item = val.substr(pos, end - pos);
+    int first = -1, last = -1;
+    char extra;
+    if (::sscanf(item.c_str(), "%d-%d%c", &first, &last, &extra) == 2) {
+      // range of CPUs.
+    } else if (::sscanf(item.c_str(), "%d%c", &first, &extra) == 1) {
+      last = first;
+    } else {
+      first = -1;
+    }
+
+    if (first < 0 || last < first || last >= n_cpu || last >= CPU_SETSIZE) {
+      throw Exception::ConfigError(key + " has invalid CPU: '" + item + "'");
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+    pos = end + 1;
   }
+  return cpus;
+}
+
+void Machine::setup(const Config& config) {
+  // Keys without "Machine." are checked by Decoder.
+  for (const auto& conf : config.map()) {
+    const std::string& key = conf.first;
+    if (key.compare(0, 8, "Machine.") != 0) {
+      continue;
+    }
 
-  Capture *cap = new PcapDev(dev_name);
+    if (key == "Machine.workers") {
+      int n = conf.second->as_int();
+      if (n < 1) {
+        throw Exception::ConfigError("Machine.workers must be positive");
+      }
+      this->workers_ = static_cast<size_t>(n);
+    } else if (key == "Machine.file_workers") {
+      int n = conf.second->as_int();
+      if (n < 1) {
+        throw Exception::ConfigError("Machine.file_workers must be positive");
+      }
+      this->file_workers_ = static_cast<size_t>(n);
+    } else if (key == "Machine.bpf_filter") {
+      this->bpf_filter_ = conf.second->as_str();
+    } else if (key == "Machine.auto_filter") {
+      this->auto_filter_ = conf.second->as_bool();
+    } else if (key == "Machine.event_wait") {
+      this->event_wait_ = conf.second->as_bool();
+    } else if (key == "Machine.busy_poll") {
+      int n = conf.second->as_int();
+      if (n < 0) {
+        throw Exception::ConfigError("Machine.busy_poll must not be negative");
+      }
+      this->busy_poll_ = n;
+    } else if (key == "Machine.drop_policy") {
+      Input::DropPolicy policy;
+      if (!Input::parse_policy(conf.second->as_str(), &policy)) {
+        throw Exception::ConfigError("Machine.drop_policy must be one of "
+                                     "block, drop or sample");
+      }
+      this->drop_policy_ = conf.second->as_str();
+    } else if (key == "Machine.sample_rate") {
+      int n = conf.second->as_int();
+      if (n < 1) {
+        throw Exception::ConfigError("Machine.sample_rate must be positive");
+      }
+      this->sample_rate_ = n;
+    } else if (key == "Machine.ring_size") {
+      int n = conf.second->as_int();
+      if (n < 2 || (n & (n - 1)) != 0) {
+        throw Exception::ConfigError("Machine.ring_size must be power of 2 "
+                                     "and >= 2");
+      }
+    } else if (key == "Machine.slot_size") {
+      if (conf.second->as_int() < 0) {
+        throw Exception::ConfigError("Machine.slot_size must not be negative");
+      }
+    } else if (key == "Machine.huge_page") {
+      conf.second->as_bool();   // check type only, used by RingBuffer.
+    } else if (key == "Machine.input_cpus") {
+      this->input_cpus_ = parse_cpus(key, conf.second->as_str());
+    } else if (key == "Machine.kernel_cpus") {
+      this->kernel_cpus_ = parse_cpus(key, conf.second->as_str());
+    } else if (key == "Machine.rt_priority") {
+      int n = conf.second->as_int();
+      if (n < 0 || n > ::sched_get_priority_max(SCHED_FIFO)) {
+        throw Exception::ConfigError("Machine.rt_priority is out of range");
+      }
+      this->rt_priority_ = n;
+    } else if (key == "Machine.prune_decode") {
+      conf.second->as_bool();   // check type only, used by Kernel.
+    } else if (key == "Machine.dispatch") {
+      conf.second->as_str();    // check type only, used by Decoder.
+    } else if (key == "Machine.async_queue") {
+      int n = conf.second->as_int();
+      if (n < 2 || (n & (n - 1)) != 0) {
+        throw Exception::ConfigError("Machine.async_queue must be power of 2 "
+                                     "and >= 2");
+      }
+    } else if (key == "Machine.async_overflow") {
+      const std::string& policy = conf.second->as_str();
+      if (policy != "block" && policy != "drop") {
+        throw Exception::ConfigError("Machine.async_overflow must be block "
+                                     "or drop");
+      }
+    } else if (key == "Machine.ring_wait") {
+      Waiter::Strategy strategy;
+      if (!Waiter::parse(conf.second->as_str(), &strategy)) {
+        throw Exception::ConfigError("Machine.ring_wait must be one of "
+                                     "sleep, spin, yield or park");
+      }
+    } else {
+      throw Exception::ConfigError("'" + key + "' is not valid config key");
+    }
+  }
+
+  if (this->workers_ > 1 && this->file_workers_ > 1) {
+    throw Exception::ConfigError("Machine.workers and Machine.file_workers "
+                                 "can not be used together");
+  }
+}
+
+Config Machine::kernel_config(const Config& config) const {
+  Config kconf(config);
+
+  // A TCP session is split into byte ranges decoded by different workers
+  // and a partial session table reassembles wrong data. Session management
+  // is turned off and TCP.data (and TCP.id) is not set in this mode.
+  if (this->file_workers_ > 1) {
+    const std::string key("TCP.enable_session_mgmt");
+    if (config.has(key) && config.get(key).as_bool()) {
+      throw Exception::ConfigError(key + " can not be used with "
+                                   "Machine.file_workers");
+    }
+    kconf.set_false(key);
+  }
+
+  return kconf;
+}
+
+void Machine::add_capture(Capture* cap) {
   if (!cap->ready()) {
     const std::string msg = cap->error();
     delete cap;
     throw Exception::ConfigError(msg);
   }
 
-  this->cap_ = cap;
+  if (!this->inputs_.empty()) {
+    delete cap;
+    throw Exception::ConfigError("data source can not be added after start");
+  }
+
+  this->caps_.push_back(cap);
+}
+
+void Machine::split_file() {
+  // Only single memory mapped pcap file can be split. Other data sources are
+  // read by single worker.
+  if (this->file_workers_ < 2 || this->caps_.size() != 1) {
+    return;
+  }
+
+  auto file = dynamic_cast<PcapMmapFile*>(this->caps_[0]);
+  if (file == nullptr) {
+    return;
+  }
+
+  for (auto reader : file->split(this->file_workers_)) {
+    this->caps_.push_back(reader);
+  }
+}
+
+void Machine::install_filter() {
+  std::string expr = this->bpf_filter_;
+
+  if (this->auto_filter_) {
+    const Decoder& dec = this->kernel_->dec();
+    const std::string derived = dec.build_filter(this->kernel_->events());
+    if (!derived.empty()) {
+      expr = expr.empty() ? derived : "(" + expr + ") and (" + derived + ")";
+    }
+  }
+
+  if (expr.empty()) {
+    return;
+  }
+
+  for (auto cap : this->caps_) {
+    if (!cap->set_filter(expr)) {
+      throw Exception::ConfigError("invalid filter '" + expr + "': " +
+                                   cap->error());
+    }
+  }
+}
+
+void Machine::add_pcapdev(const std::string &dev_name) {
+  this->add_capture(new PcapDev(dev_name));
 }
 
 void Machine::add_pcapfile(const std::string &file_path) {
-  if (this->cap_) {
-    throw Exception::ConfigError("data source has been configured");
+  // Compressed file is decompressed on the fly instead of being mapped.
+  if (PcapStreamFile::is_compressed(file_path)) {
+    this->add_capture(new PcapStreamFile(file_path));
+    return;
   }
 
-  Capture *cap = new PcapFile(file_path);
+  // Prefer the mmap based reader and fall back to libpcap for files that
+  // can not be mapped (e.g. pipe) or whose format is not supported by it.
+  Capture* cap = new PcapMmapFile(file_path);
   if (!cap->ready()) {
-    const std::string msg = cap->error();
     delete cap;
-    throw Exception::ConfigError(msg);
+    cap = new PcapFile(file_path);
   }
 
-  this->cap_ = cap;
+  this->add_capture(cap);
+}
+
+void Machine::add_afpacket(const std::string &dev_name,
+                           const Config& config) {
+#ifdef __linux__
+  const int fanout = config.has("fanout") ? config.get("fanout").as_int() : 1;
+  if (fanout <= 1) {
+    this->add_capture(new AfPacket(dev_name, config));
+    return;
+  }
+
+  // Open sockets of PACKET_FANOUT group, one socket for each queue.
+  const uint16_t group = AfPacket::new_fanout_group();
+  std::vector<Capture*> socks;
+  for (int i = 0; i < fanout; i++) {
+    Capture* cap = new AfPacket(dev_name, config, group, i);
+    socks.push_back(cap);
+    if (!cap->ready()) {
+      const std::string msg = cap->error();
+      for (auto s : socks) {
+        delete s;
+      }
+      throw Exception::ConfigError(msg);
+    }
+  }
+
+  for (auto s : socks) {
+    this->add_capture(s);
+  }
+#else
+  throw Exception::ConfigError("AF_PACKET is supported in only Linux");
+#endif
 }
 
 const std::string& Machine::data_source_name() const {
   static const std::string none("");
   
-  if (this->cap_) {
-    return this->cap_->src_name();
+  if (!this->caps_.empty()) {
+    return this->caps_[0]->src_name();
   } else {
     return none;
   }
@@ -185,20 +643,76 @@ void Machine::loop() {
 
 
 void Machine::start() {
-  if (!this->cap_) {
+  if (this->caps_.empty()) {
     throw Exception::ConfigError("no input source is available");
   }
 
+  this->split_file();
+  this->install_filter();
+
+  // Packets of queue N (range of split file or socket of PACKET_FANOUT) are
+  // decoded by N-th kernel. Data sources feeding same kernel share module
+  // state (e.g. TCP session table) and offline sources are merged in
+  // timestamp order. With Machine.workers, every data source feeds all
+  // kernels and its Input routes packets by flow hash.
+  size_t kernel_size = 1;
+  for (auto cap : this->caps_) {
+    kernel_size = std::max(kernel_size, cap->queue() + 1);
+  }
+  if (this->workers_ > 1) {
+    kernel_size = this->workers_;
+  }
+  this->kernel_->resize(kernel_size);
+
+  std::vector<std::vector<PktChannel> > channels;
+  std::vector<size_t> used(kernel_size, 0);
+  std::vector<bool> offline(kernel_size, true);
+  for (auto cap : this->caps_) {
+    std::vector<PktChannel> cap_channels;
+    for (size_t q = 0; q < kernel_size; q++) {
+      if (this->workers_ < 2 && q != cap->queue()) {
+        continue;
+      }
+      Kernel* kernel = this->kernel_->at(q);
+      cap_channels.push_back(used[q] == 0 ? kernel->pkt_channel() :
+                             kernel->add_pkt_channel());
+      used[q]++;
+      offline[q] = offline[q] && cap->is_offline();
+    }
+    channels.push_back(cap_channels);
+  }
+  for (size_t q = 0; q < kernel_size; q++) {
+    Kernel* kernel = this->kernel_->at(q);
+    kernel->set_merge(offline[q]);
+    kernel->set_sched(this->kernel_cpus_.empty() ? -1 :
+                      this->kernel_cpus_[q % this->kernel_cpus_.size()],
+                      this->rt_priority_);
+  }
+
   this->kernel_->start();
-  this->input_ = new Input(this->cap_, this->kernel_->pkt_channel());
-  this->input_->start();
+
+  Input::DropPolicy policy = Input::BLOCK;
+  Input::parse_policy(this->drop_policy_, &policy);
+  for (size_t i = 0; i < this->caps_.size(); i++) {
+    Capture* cap = this->caps_[i];
+    const int fd = this->event_wait_ ? cap->selectable_fd() : -1;
+    Input* input = new Input(cap, channels[i], fd, this->busy_poll_,
+                             policy, this->sample_rate_);
+    input->set_sched(this->input_cpus_.empty() ? -1 :
+                     this->input_cpus_[i % this->input_cpus_.size()],
+                     this->rt_priority_);
+    this->inputs_.push_back(input);
+    input->start();
+  }
 }
 
 bool Machine::join(struct timespec* timeout) {
-  if (timeout) {
-    this->input_->join(*timeout);
-  } else {
-    this->input_->join();
+  for (auto input : this->inputs_) {
+    if (timeout) {
+      input->join(*timeout);
+    } else {
+      input->join();
+    }
   }
   
   this->kernel_->join();
@@ -208,19 +722,44 @@ bool Machine::join(struct timespec* timeout) {
 
 
 void Machine::halt() {
-  this->input_->stop();
+  for (auto input : this->inputs_) {
+    input->stop();
+  }
   this->kernel_->stop();
 }
 
 
 Handler Machine::on(const std::string& event_name,
-                 std::function<void(const Property&)>&& callback) {
+                    std::function<void(const Property&)>&& callback,
+                    bool async) {
   assert(this->kernel_);
-  HandlerPtr ptr = this->kernel_->on(event_name, std::move(callback));
+  if (this->file_workers_ > 1) {
+    const Decoder& dec = this->kernel_->dec();
+    event_id eid = dec.lookup_event_id(event_name);
+    if (eid != Event::NONE && dec.is_stateful_event(eid)) {
+      throw Exception::ConfigError(event_name + " is not available with "
+                                   "Machine.file_workers");
+    }
+  }
+
+  HandlerPtr ptr = this->kernel_->on(event_name, std::move(callback), async);
   Handler hdlr(ptr, this->kernel_);
   return hdlr;
 }
 
+uint64_t Machine::drop_pkt() const {
+  uint64_t sum = 0;
+  for (auto input : this->inputs_) {
+    sum += input->drop_pkt();
+  }
+  return sum;
+}
+
+uint64_t Machine::async_drop() const {
+  assert(this->kernel_);
+  return this->kernel_->async_drop();
+}
+
 uint64_t Machine::recv_pkt() const {
   assert(this->kernel_);
   return this->kernel_->recv_pkt();
@@ -29,6 +29,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 #include <functional>
 
 #include "./packetmachine/common.hpp"
@@ -41,17 +42,17 @@ namespace pm {
 
 class Capture;
 class Input;
-class Kernel;
+class KernelGroup;
 class HandlerEntity;
 
 
 class Handler {
  private:
   std::weak_ptr<HandlerEntity> ptr_;
-  std::weak_ptr<Kernel> kernel_;
+  std::weak_ptr<KernelGroup> kernel_;
  public:
   Handler(std::shared_ptr<HandlerEntity> ptr,
-          std::shared_ptr<Kernel> kernel);
+          std::shared_ptr<KernelGroup> kernel);
   ~Handler();
   bool is_active() const;
   bool activate();
@@ -60,20 +61,112 @@ class Handler {
 };
 
 
+// Machine accepts following config keys in addition to module configs.
+//
+// - Machine.workers: Number of Kernel threads decoding packets. The reader of
+//   each data source routes a packet to a worker by symmetric hash of its
+//   5-tuple, then both directions of a flow are decoded by the same worker
+//   in arrival order. Each worker has own Decoder and module state (e.g. TCP
+//   session table). Callbacks are invoked by worker threads at same time;
+//   callbacks for packets of one flow are serialized in order, but shared
+//   data accessed by callbacks must be protected by callers. Can not be
+//   combined with Machine.file_workers.
+// - Machine.file_workers: Number of workers to decode one pcap file. The file
+//   is split into byte ranges starting on record boundaries and each range is
+//   decoded by own Kernel thread. Callbacks can be invoked by multiple
+//   threads at same time and events depending on session state (e.g.
+//   TCP.new_session) are not available in this mode. TCP session management
+//   is turned off, so TCP.data and TCP.id are not set. Use
+//   Property::worker() to keep results per worker and merge them after
+//   loop().
+// - Machine.bpf_filter: BPF expression (same syntax as tcpdump). Packets not
+//   matching the expression are dropped by data source before decoding.
+// - Machine.auto_filter: If true, build BPF expression from events having
+//   handler(s) at start() (e.g. "udp port 53" for DNS.query) and drop other
+//   packets. Handlers registered after start() may miss packets. Combined
+//   with Machine.bpf_filter by "and" if both are given.
+// - Machine.event_wait: If true, wait for packets of a live data source by
+//   epoll (poll on non Linux) on its selectable fd instead of sleeping and
+//   polling. Offline sources are not affected.
+// - Machine.busy_poll: Number of empty reads before blocking in event_wait
+//   mode. Larger value reduces latency and uses more CPU.
+// - Machine.ring_wait: How a thread waits for the ring between capture and
+//   decoding threads. "sleep" (default, backoff by usleep), "spin", "yield"
+//   (spin then sched_yield) or "park" (spin then sleep until the other side
+//   pushes or pulls).
+// - Machine.ring_size: Number of slots of the ring (power of 2, default
+//   4096). Deep ring absorbs bursts of live capture and small ring keeps
+//   working set in cache.
+// - Machine.slot_size: Buffer size of each slot (default 2048). Buffers of
+//   all slots are one contiguous slab and larger packet is copied into own
+//   buffer of the slot. 0 allocates buffers on demand.
+// - Machine.huge_page: If true, allocate the slab on huge pages.
+// - Machine.drop_policy: What the reader of a data source does when the ring
+//   is full. "block" (default) waits for decoding, then drops happen in the
+//   data source (e.g. socket buffer) and are not counted. "drop" reads and
+//   drops new packets. "sample" drops like "drop" and, while the ring is
+//   half full or more, pushes only 1 of Machine.sample_rate packets. Dropped
+//   packets are counted by drop_pkt().
+// - Machine.sample_rate: Sampling rate of "sample" policy (default 10).
+// - Machine.prune_decode: If true, decode only modules needed by events
+//   having handler(s) and their upper modules (e.g. Ethernet, IPv4 and UDP
+//   for DNS.query). Values of other modules are not available in callbacks
+//   and session state of skipped modules (e.g. TCP) is not tracked.
+// - Machine.dispatch: Comma separated bindings added to the dispatch tables
+//   of decoder modules, e.g. "udp.port:5300=DNS,ethertype:0x88a8=Dot1Q".
+//   Spaces are "ethertype", "ppp.proto", "ip.proto", "udp.port" and
+//   "tcp.port".
+// - Machine.async_queue: Number of snapshots queued to asynchronous
+//   callbacks per Kernel (power of 2, default 1024).
+// - Machine.async_overflow: What Kernel does when the queue is full. "block"
+//   (default) waits for the callbacks, "drop" skips asynchronous callbacks
+//   for the packet and counts it by async_drop().
+// - Machine.input_cpus: CPUs to pin reader threads of data sources, e.g.
+//   "0,2" or "0-3". i-th data source is pinned to (i % n)-th CPU of the list.
+// - Machine.kernel_cpus: CPUs to pin Kernel threads in the same way. Slot
+//   buffers of rings read by a pinned Kernel are allocated on NUMA node of
+//   the CPU.
+// - Machine.rt_priority: If positive, reader and Kernel threads run by
+//   SCHED_FIFO with the priority (needs CAP_SYS_NICE). start() throws
+//   RunTimeError if the thread can not be created with it.
+
 class Machine {
  private:
-  Capture *cap_;
-  Input *input_;
-  std::shared_ptr<Kernel> kernel_;
+  std::vector<Capture*> caps_;
+  std::vector<Input*> inputs_;
+  std::shared_ptr<KernelGroup> kernel_;
+  size_t workers_;
+  size_t file_workers_;
+  std::string bpf_filter_;
+  bool auto_filter_;
+  bool event_wait_;
+  int busy_poll_;
+  std::string drop_policy_;
+  int sample_rate_;
+  std::vector<int> input_cpus_;
+  std::vector<int> kernel_cpus_;
+  int rt_priority_;
+
+  void setup(const Config& config);
+  Config kernel_config(const Config& config) const;
+  void add_capture(Capture* cap);
+  void split_file();
+  void install_filter();
 
  public:
   Machine();
   explicit Machine(const Config& config);
   ~Machine();
 
-  // Configure data source.
+  // Configure data source. Multiple data sources can be added and each
+  // source is read by own thread. Packets of offline sources (pcap files)
+  // are decoded in timestamp order. data_source_name() returns name of the
+  // first source. add_pcapfile() also accepts pcap file compressed by gzip,
+  // zstd or lz4.
   void add_pcapdev(const std::string& dev_name);
   void add_pcapfile(const std::string& file_path);
+  void add_afpacket(const std::string& dev_name,
+                    const Config& config = Config());
   const std::string& data_source_name() const;
 
   // Run capture & packet decodeing and wait
@@ -84,11 +177,22 @@ class Machine {
   bool join(struct timespec* timeout = nullptr);
   void halt();
 
+  // Register callback for event. With async, the callback is called by
+  // another thread than decoding one, with a snapshot of Property that is
+  // valid during the callback. Decoding goes on while the callback runs, so
+  // a slow callback does not stall it. Asynchronous callbacks of one Kernel
+  // are called by one thread in packet order.
   Handler on(const std::string& event_name,
-             std::function<void(const Property&)>&& callback);
+             std::function<void(const Property&)>&& callback,
+             bool async = false);
 
   uint64_t recv_pkt() const;
   uint64_t recv_size() const;
+  // Number of packets dropped by Machine.drop_policy.
+  uint64_t drop_pkt() const;
+  // Number of packets whose asynchronous callbacks are skipped by
+  // Machine.async_overflow.
+  uint64_t async_drop() const;
 
   const ParamKey& lookup_param_key(const std::string& name) const;
   const std::string& lookup_param_name(const ParamKey& key) const;
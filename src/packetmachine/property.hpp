@@ -33,6 +33,7 @@
 #include <memory>
 #include <functional>
 #include "./common.hpp"
+#include "./value.hpp"
 
 namespace tb {
 class Buffer;
@@ -95,15 +96,35 @@ class ParamKey {
 
 class Property {
  private:
+  // Location of a value recorded by set_value(). Value object is built from
+  // it when value() is called first time for the packet. A field is valid
+  // only if gen is same as gen_ that is changed by init().
+  struct Field {
+    const ParamDef* def;
+    const void* ptr;
+    size_t len;
+    Value::Endian endian;
+    uint64_t gen;
+  };
+
   std::weak_ptr<Decoder> dec_;
   std::vector<size_t> param_idx_;
   std::vector< std::vector<Value*>* > param_;
+  mutable std::vector<Field> field_;
+  uint64_t gen_;
   size_t event_idx_;
   std::vector<const EventDef*> event_;
+  size_t worker_;
 
   const Packet* pkt_;
   static const Value null_;
 
+  bool has_field(param_id pid) const {
+    return (static_cast<size_t>(pid) < this->field_.size() &&
+            this->field_[pid].gen == this->gen_);
+  }
+  void build_value(param_id pid) const;
+
   tb::Buffer* src_addr_;
   tb::Buffer* dst_addr_;
   uint16_t src_port_;
@@ -117,10 +138,24 @@ class Property {
   static const ParamKey NULL_KEY;
   
   void set_decoder(std::shared_ptr<Decoder> dec);
+  void set_worker(size_t worker) { this->worker_ = worker; }
   void init(const Packet* pkt);
+  // Exchange decoded values and events with prop. Packet, Decoder and worker
+  // are not exchanged.
+  void swap(Property* prop);
+  // Make values independent from memory other than data of the packet
+  // (e.g. TCP reassembly buffer of the session).
+  void detach();
 
   // Retain data
   Value* retain_value(const ParamDef* def);
+  // Record only location of data instead of building Value object. It is
+  // built by value() if a handler reads it, so a module should use it for
+  // data in the packet that is not read by the module itself. Only the first
+  // call for a parameter in a packet takes effect, and a parameter must not
+  // be set by both set_value() and retain_value().
+  void set_value(const ParamDef* def, const void* ptr, size_t len,
+                 Value::Endian e = Value::BIG);
 
   // Push event
   void push_event(const EventDef* def);
@@ -139,6 +174,11 @@ class Property {
   // packet size
   size_t pkt_size() const;
 
+  // Index of worker (Kernel thread) that decoded the packet, from 0 to
+  // Machine.workers or Machine.file_workers - 1. Callbacks can keep results
+  // per worker without lock and merge them after loop().
+  size_t worker() const { return this->worker_; }
+
   // timestamp
   time_t ts() const;
   double ts_d() const;
@@ -92,6 +92,9 @@ class Value {
 
   void set(const void* ptr, size_t len, Endian e = BIG);
   void cpy(const void* ptr, size_t len, Endian e = BIG);
+  // Copy data referring memory out of [begin, end) into own buffer, then the
+  // value is available while only the range is kept (e.g. packet data).
+  virtual void detach(const byte_t* begin, const byte_t* end);
 
   virtual inline void clear() { this->active_ = false; }
   virtual void repr(std::ostream &os) const;
@@ -178,6 +181,7 @@ class Array : public Value {
   virtual ~Array();
   virtual void clear();
   virtual void repr(std::ostream &os) const;
+  virtual void detach(const byte_t* begin, const byte_t* end);
 
   virtual size_t size() const;
   virtual bool is_array() const { return true; }
@@ -197,6 +201,7 @@ class Map : public Value {
   virtual ~Map();
   virtual void clear();
   virtual void repr(std::ostream &os) const;
+  virtual void detach(const byte_t* begin, const byte_t* end);
 
   virtual size_t size() const;
   virtual bool is_map() const { return true; }
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <utility>
 #include "./packetmachine/property.hpp"
 #include "./packet.hpp"
 #include "./decoder.hpp"
@@ -96,7 +97,7 @@ const Value Property::null_;
 const ParamKey Property::NULL_KEY;
 
 
-Property::Property() {
+Property::Property() : gen_(1), worker_(0) {
   this->src_addr_ = new tb::Buffer();
   this->dst_addr_ = new tb::Buffer();
 }
@@ -122,10 +123,41 @@ void Property::init(const Packet *pkt) {
   for (size_t i = 0; i < this->param_idx_.size(); i++) {
     this->param_idx_[i] = 0;
   }
+  this->gen_++;   // invalidate all fields.
   this->event_idx_ = 0;
 }
 
 
+void Property::swap(Property* prop) {
+  std::swap(this->param_idx_, prop->param_idx_);
+  std::swap(this->param_, prop->param_);
+  std::swap(this->field_, prop->field_);
+  std::swap(this->gen_, prop->gen_);
+  std::swap(this->event_idx_, prop->event_idx_);
+  std::swap(this->event_, prop->event_);
+  std::swap(this->src_addr_, prop->src_addr_);
+  std::swap(this->dst_addr_, prop->dst_addr_);
+  std::swap(this->src_port_, prop->src_port_);
+  std::swap(this->dst_port_, prop->dst_port_);
+}
+
+void Property::detach() {
+  const byte_t* begin = this->pkt_->buf();
+  const byte_t* end = begin + this->pkt_->len();
+  for (size_t pid = 0; pid < this->field_.size(); pid++) {
+    const Field& f = this->field_[pid];
+    auto ptr = static_cast<const byte_t*>(f.ptr);
+    if (f.gen == this->gen_ && (ptr < begin || end < ptr + f.len)) {
+      this->build_value(static_cast<param_id>(pid));
+    }
+  }
+  for (size_t pid = 0; pid < this->param_idx_.size(); pid++) {
+    for (size_t i = 0; i < this->param_idx_[pid]; i++) {
+      (*this->param_[pid])[i]->detach(begin, end);
+    }
+  }
+}
+
 Value* Property::retain_value(const ParamDef* def) {
   const param_id pid = def->id();
   Value* obj;
@@ -150,6 +182,35 @@ Value* Property::retain_value(const ParamDef* def) {
   return obj;
 }
 
+void Property::set_value(const ParamDef* def, const void* ptr, size_t len,
+                         Value::Endian e) {
+  const param_id pid = def->id();
+  const size_t idx = static_cast<size_t>(pid);
+
+  if (idx >= this->field_.size()) {
+    this->field_.resize(idx + 1, Field{nullptr, nullptr, 0, Value::BIG, 0});
+  }
+
+  Field& f = this->field_[idx];
+  if (f.gen == this->gen_ ||
+      (idx < this->param_idx_.size() && this->param_idx_[idx] > 0)) {
+    return;   // keep the first one.
+  }
+
+  f.def = def;
+  f.ptr = ptr;
+  f.len = len;
+  f.endian = e;
+  f.gen = this->gen_;
+}
+
+void Property::build_value(param_id pid) const {
+  Field& f = this->field_[pid];
+  f.gen = 0;
+  const_cast<Property*>(this)->retain_value(f.def)->set(f.ptr, f.len,
+                                                        f.endian);
+}
+
 void Property::push_event(const EventDef* def) {
   if (this->event_idx_ + 1 > this->event_.size()) {
     this->event_.push_back(def);
@@ -202,7 +263,9 @@ const struct timeval& Property::tv() const {
 }
 
 bool Property::has_value(const ParamKey& key) const {
-  return (this->param_idx_[key.id()] > 0);
+  // Parameter of a module that has never been decoded is not allocated.
+  return ((static_cast<size_t>(key.id()) < this->param_idx_.size() &&
+           this->param_idx_[key.id()] > 0) || this->has_field(key.id()));
 }
 
 bool Property::has_value(const std::string& name) const {
@@ -220,7 +283,11 @@ bool Property::has_value(const std::string& name) const {
 
 
 const Value& Property::value(const ParamKey& key) const {
-  if (this->param_idx_[key.id()] > 0) {
+  if (this->has_field(key.id())) {
+    this->build_value(key.id());
+  }
+
+  if (this->has_value(key)) {
     Value* val = dynamic_cast<Value*>((*this->param_[key.id()])[0]);
     if (val) {
       ParamDef *def = key.def();
@@ -27,17 +27,73 @@
 #include "./thread.hpp"
 #include "./packetmachine/exception.hpp"
 #include <assert.h>
+#include <sched.h>
+#include <string.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string>
 
 namespace pm {
 
-Thread::Thread() {
+Thread::Thread() : cpu_(-1), priority_(0) {
 }
 
 Thread::~Thread() {
 }
 
 void Thread::start() {
-  pthread_create(&this->th_, nullptr, Thread::run_thread, this);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+
+#ifdef __linux__
+  if (this->cpu_ >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(this->cpu_, &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+  }
+#endif
+  if (this->priority_ > 0) {
+    struct sched_param param;
+    param.sched_priority = this->priority_;
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &param);
+  }
+
+  int rc = pthread_create(&this->th_, &attr, Thread::run_thread, this);
+  pthread_attr_destroy(&attr);
+  if (rc != 0) {
+    throw Exception::RunTimeError(std::string("fail to create thread: ") +
+                                  ::strerror(rc));
+  }
+}
+
+void Thread::set_sched(int cpu, int priority) {
+  this->cpu_ = cpu;
+  this->priority_ = priority;
+}
+
+int Thread::cpu_node(int cpu) {
+  // cpuN directory has a link named nodeM.
+  const std::string path = "/sys/devices/system/cpu/cpu" +
+                           std::to_string(cpu);
+  DIR* dir = ::opendir(path.c_str());
+  if (dir == nullptr) {
+    return -1;
+  }
+
+  int node = -1;
+  struct dirent* ent;
+  while ((ent = ::readdir(dir)) != nullptr) {
+    if (::strncmp(ent->d_name, "node", 4) == 0 &&
+        ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+      node = ::atoi(ent->d_name + 4);
+      break;
+    }
+  }
+  ::closedir(dir);
+  return node;
 }
 
 void Thread::join() {
@@ -31,15 +31,24 @@
 
 namespace pm {
 
+// Thread can be pinned to a CPU and run with real-time priority by
+// set_sched() before start(). CPU affinity is supported only on Linux.
+
 class Thread {
  private:
   pthread_t th_;
+  int cpu_;        // CPU to run on, or -1.
+  int priority_;   // SCHED_FIFO priority, or 0 for default scheduling.
   
  public:
   Thread();
   virtual ~Thread();
   virtual void thread_main() = 0;
   virtual void start();
+  void set_sched(int cpu, int priority = 0);
+  int cpu() const { return this->cpu_; }
+  // Return NUMA node of cpu, or -1 if unknown.
+  static int cpu_node(int cpu);
   void join();
   void join(const struct timespec& timeout);
   void stop();
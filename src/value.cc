@@ -79,6 +79,14 @@ void Value::cpy(const void* ptr, size_t len, Endian e) {
 }
 
 
+void Value::detach(const byte_t* begin, const byte_t* end) {
+  if (this->active_ && this->ptr_ && this->ptr_ != this->buf_ &&
+      (this->ptr_ < begin || this->ptr_ + this->len_ > end)) {
+    this->cpy(this->ptr_, this->len_, this->endian_);
+  }
+}
+
+
 void Value::repr(std::ostream &os) const {
   if (this->active_) {
     for (size_t i = 0; i < this->len_; i++) {
@@ -325,6 +333,13 @@ void Array::repr(std::ostream &os) const {
   os << "]";
 }
 
+void Array::detach(const byte_t* begin, const byte_t* end) {
+  Value::detach(begin, end);
+  for (auto it : this->array_) {
+    it->detach(begin, end);
+  }
+}
+
 size_t Array::size() const {
   return this->array_.size();
 }
@@ -363,6 +378,15 @@ void Map::repr(std::ostream &os) const {
 }
 
 
+void Map::detach(const byte_t* begin, const byte_t* end) {
+  Value::detach(begin, end);
+  for (const auto& it : this->map_) {
+    if (it.second) {
+      it.second->detach(begin, end);
+    }
+  }
+}
+
 size_t Map::size() const {
   return this->map_.size();
 }
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2017 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp> All
+ * rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <vector>
+
+#include "./gtest/gtest.h"
+#include "../src/capture.hpp"
+#include "../src/packet.hpp"
+#include "../src/packetmachine.hpp"
+
+#ifdef __linux__
+
+TEST(AfPacket, ng_invalid_config_key) {
+  pm::Config config;
+  config.set("no_such_key", 1);
+  pm::AfPacket cap("lo", config);
+  ASSERT_FALSE(cap.ready());
+  EXPECT_EQ("'no_such_key' is not valid config key", cap.error());
+
+  pm::Packet pkt;
+  EXPECT_EQ(pm::Capture::ERROR, cap.read(&pkt));
+}
+
+TEST(AfPacket, ng_invalid_block_size) {
+  pm::Config config;
+  config.set("block_size", 5000);
+  pm::AfPacket cap("lo", config);
+  ASSERT_FALSE(cap.ready());
+  EXPECT_EQ("block_size must be power of 2 and >= page size", cap.error());
+}
+
+TEST(AfPacket, ng_invalid_fanout) {
+  pm::Config config;
+  config.set("fanout", 0);
+  pm::AfPacket cap("lo", config);
+  ASSERT_FALSE(cap.ready());
+  EXPECT_EQ("fanout must be between 1 and 65535", cap.error());
+}
+
+TEST(AfPacket, ng_no_such_device) {
+  pm::AfPacket cap("no-such-dev0", pm::Config());
+  ASSERT_FALSE(cap.ready());
+  EXPECT_EQ(0u, cap.error().find("no-such-dev0: if_nametoindex"));
+}
+
+TEST(AfPacket, ng_machine_no_such_device) {
+  pm::Machine m;
+  EXPECT_THROW(m.add_afpacket("no-such-dev0"), pm::Exception::ConfigError);
+}
+
+// Skip a test. This version of gtest does not have GTEST_SKIP().
+#ifndef GTEST_SKIP
+#define GTEST_SKIP() \
+  return GTEST_MESSAGE_("Skipped", ::testing::TestPartResult::kSuccess)
+#endif
+
+namespace afpacket_test {
+
+const char MARKER[] = "packetmachine-afpacket-test";
+
+void send_udp(int count) {
+  int sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+  ASSERT_LE(0, sock);
+  struct sockaddr_in addr;
+  ::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(9);   // discard
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int i = 0; i < count; i++) {
+    ::sendto(sock, MARKER, sizeof(MARKER), 0,
+             reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+  }
+  ::close(sock);
+}
+
+bool has_marker(const pm::Packet& pkt) {
+  return nullptr != ::memmem(pkt.buf(), pkt.cap_len(), MARKER, sizeof(MARKER));
+}
+
+// Read packets for msec and return number of packets having MARKER. Read
+// packets are released at once.
+int drain(pm::AfPacket* cap, int msec) {
+  pm::Packet pkt;
+  int found = 0;
+  for (int i = 0; i < msec; i++) {
+    pm::Capture::Result rc;
+    while (pm::Capture::OK == (rc = cap->read(&pkt))) {
+      found += has_marker(pkt) ? 1 : 0;
+      pkt.release();
+    }
+    EXPECT_NE(pm::Capture::ERROR, rc);
+    ::usleep(1000);
+  }
+  return found;
+}
+
+// Send Ethernet frames with VLAN tags of tpids and UDP datagram having
+// MARKER to 127.0.0.1:9 via packet socket on lo, and return the frame. The
+// kernel strips the outer tag of received frame in software, and sent frame
+// is seen by capture sockets as is.
+std::vector<uint8_t> send_tagged(const std::vector<uint16_t>& tpids,
+                                 int count) {
+  std::vector<uint8_t> frame(12, 0);   // MAC addresses
+  for (auto tpid : tpids) {
+    const uint8_t tag[4] = {static_cast<uint8_t>(tpid >> 8),
+                            static_cast<uint8_t>(tpid & 0xff), 0, 100};
+    frame.insert(frame.end(), tag, tag + sizeof(tag));
+  }
+  const uint16_t ip_len = 20 + 8 + sizeof(MARKER);
+  const uint8_t hdr[] = {
+    0x08, 0x00,
+    0x45, 0, ip_len >> 8, ip_len & 0xff, 0, 0, 0, 0, 64, 17, 0, 0,
+    127, 0, 0, 1, 127, 0, 0, 1,
+    0x30, 0x39, 0, 9, 0, 8 + sizeof(MARKER), 0, 0,
+  };
+  frame.insert(frame.end(), hdr, hdr + sizeof(hdr));
+  frame.insert(frame.end(), MARKER, MARKER + sizeof(MARKER));
+
+  int sock = ::socket(AF_PACKET, SOCK_RAW, 0);
+  EXPECT_LE(0, sock);
+  struct sockaddr_ll addr;
+  ::memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_ifindex = ::if_nametoindex("lo");
+  addr.sll_halen = 6;
+  for (int i = 0; sock >= 0 && i < count; i++) {
+    ::sendto(sock, frame.data(), frame.size(), 0,
+             reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+  }
+  ::close(sock);
+  return frame;
+}
+
+// Read packets for msec and return number of packets having MARKER. Number
+// of them same as frame and copied (not lent) are also counted.
+int drain_frame(pm::AfPacket* cap, int msec, const std::vector<uint8_t>& frame,
+                int* same, int* copied) {
+  pm::Packet pkt;
+  int found = 0;
+  for (int i = 0; i < msec; i++) {
+    while (pm::Capture::OK == cap->read(&pkt)) {
+      if (has_marker(pkt)) {
+        found++;
+        if (pkt.cap_len() == frame.size() &&
+            ::memcmp(pkt.buf(), frame.data(), frame.size()) == 0) {
+          (*same)++;
+        }
+        (*copied) += pkt.is_lent() ? 0 : 1;
+      }
+      pkt.release();
+    }
+    ::usleep(1000);
+  }
+  return found;
+}
+
+}   // namespace afpacket_test
+
+TEST(AfPacket, ok_give_back_block) {
+  using namespace afpacket_test;
+
+  // Two small blocks, then a packet that is not released keeps its block
+  // from the kernel and the reader stops at the block.
+  pm::Config config;
+  config.set("block_size", ::getpagesize());
+  config.set("block_count", 2);
+  config.set("block_timeout", 1);
+  pm::AfPacket cap("lo", config);
+  if (!cap.ready()) {
+    GTEST_SKIP() << cap.error();   // e.g. no CAP_NET_RAW.
+  }
+
+  send_udp(1);
+  pm::Packet held;
+  for (int i = 0; i < 1000; i++) {
+    if (cap.read(&held) == pm::Capture::OK) {
+      if (has_marker(held)) {
+        break;
+      }
+      held.release();
+    } else {
+      ::usleep(1000);
+    }
+  }
+  ASSERT_TRUE(held.is_lent());
+  ASSERT_TRUE(has_marker(held));
+  EXPECT_EQ(0x0800, (held.buf()[12] << 8) | held.buf()[13]);
+
+  // Fill both blocks. The reader walks the other block and waits for the
+  // held one, and the kernel drops packets because no block is free.
+  send_udp(200);
+  EXPECT_GT(200, drain(&cap, 100));
+  send_udp(20);
+  EXPECT_EQ(0, drain(&cap, 50));
+
+  // Releasing the packet gives the block back to the kernel.
+  held.release();
+  send_udp(20);
+  EXPECT_LT(0, drain(&cap, 100));
+}
+
+TEST(AfPacket, ok_vlan_tag) {
+  using namespace afpacket_test;
+
+  // 802.1Q, and QinQ (802.1ad + 802.1Q).
+  for (auto tpids : {std::vector<uint16_t>{0x8100},
+                     std::vector<uint16_t>{0x88a8, 0x8100}}) {
+    pm::AfPacket cap("lo", pm::Config());
+    if (!cap.ready()) {
+      GTEST_SKIP() << cap.error();   // e.g. no CAP_NET_RAW.
+    }
+
+    // Both sent frames and received frames of which the outer tag was
+    // stripped by the kernel have same tags as original.
+    auto frame = send_tagged(tpids, 10);
+    int same = 0, copied = 0;
+    int found = drain_frame(&cap, 100, frame, &same, &copied);
+    EXPECT_LT(0, found);
+    EXPECT_EQ(found, same);
+    EXPECT_LT(0, copied);
+  }
+}
+
+TEST(AfPacket, ok_vlan_filter) {
+  using namespace afpacket_test;
+
+  // Filter on AfPacket matches frames of which tag was stripped by the
+  // kernel as well as frames having tags in data.
+  for (auto tpids : {std::vector<uint16_t>{0x8100},
+                     std::vector<uint16_t>{0x88a8, 0x8100}}) {
+    pm::AfPacket plain("lo", pm::Config());
+    if (!plain.ready()) {
+      GTEST_SKIP() << plain.error();   // e.g. no CAP_NET_RAW.
+    }
+    pm::AfPacket cap("lo", pm::Config());
+    ASSERT_TRUE(cap.ready());
+    const std::string expr = (tpids.size() == 1) ?
+                             "vlan and udp port 9" :
+                             "vlan and vlan and udp port 9";
+    ASSERT_TRUE(cap.set_filter(expr)) << cap.error();
+
+    send_udp(10);
+    auto frame = send_tagged(tpids, 10);
+    int same = 0, copied = 0, plain_same = 0, plain_copied = 0;
+    int found = drain_frame(&cap, 100, frame, &same, &copied);
+    int plain_found = drain_frame(&plain, 10, frame, &plain_same,
+                                  &plain_copied);
+
+    // Untagged datagrams are dropped and all tagged frames pass.
+    EXPECT_LT(0, same);
+    EXPECT_EQ(same, found);
+    EXPECT_EQ(plain_same, same);
+    EXPECT_EQ(plain_copied, copied);
+    EXPECT_LT(same, plain_found);
+  }
+}
+
+TEST(AfPacket, ng_machine_fanout_no_such_device) {
+  pm::Machine m;
+  pm::Config config;
+  config.set("fanout", 4);
+  EXPECT_THROW(m.add_afpacket("no-such-dev0", config),
+               pm::Exception::ConfigError);
+  EXPECT_EQ("", m.data_source_name());
+}
+
+#endif   // __linux__
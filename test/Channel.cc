@@ -25,8 +25,12 @@
  */
 
 #include <pthread.h>
+#include <stdio.h>
+#include <time.h>
 #include <random>
 #include "../src/channel.hpp"
+#include "../src/packet.hpp"
+#include "../src/thread.hpp"
 #include "./gtest/gtest.h"
 
 
@@ -182,75 +186,394 @@ TEST(RingBuffer, ok_slow_consumer) {
 }
 
 
-}    // namespace ring_buffer
+void* batch_provider(void* obj) {
+  Prop *p = static_cast<Prop*>(obj);
+  pm::RingBuffer<Data>* ch = p->ch_;
+  Data* slots[64];
+  int idx = 1;
 
-namespace msg_queue {
+  for (size_t i = 0; i < p->send_count_; ) {
+    size_t n = ch->retain_batch(slots, 64);
+    if (n > p->send_count_ - i) {
+      n = p->send_count_ - i;
+    }
 
-struct Data {
-  int p_;
-};
+    for (size_t j = 0; j < n; j++) {
+      slots[j]->idx_ = idx++;
+    }
+    ch->push_batch(slots, n);
+    i += n;
+  }
 
-class Args {
- public:
-  pm::MsgQueue<Data*> *q_;
-  int wait_;
-  int recv_;
-  Args(pm::MsgQueue<Data*> *q) : q_(q), wait_(0), recv_(0) {}
-};
+  ch->close();
+  return nullptr;
+}
 
-int delay(int n) {
-  int c = 0;
-  for (int i = 2; i < n; i++) {
-    if (prime(i)) {
-      c++;
+TEST(RingBuffer, ok_batch_provider) {
+  Prop p;
+  const int count = 100000;
+  p.ch_ = new pm::RingBuffer<Data>();
+  p.send_count_ = count;
+  p.recv_load_ = 0xff;
+
+  pthread_t t1, t2;
+  pthread_create(&t1, nullptr, batch_provider, &p);
+  pthread_create(&t2, nullptr, consumer, &p);
+
+  pthread_join(t1, nullptr);
+  pthread_join(t2, nullptr);
+
+  EXPECT_EQ(p.seq_mismatch_, 0);
+  EXPECT_EQ(p.recv_count_, count);
+  delete p.ch_;
+}
+
+void* batch_consumer(void* obj) {
+  Prop *p = static_cast<Prop*>(obj);
+  pm::RingBuffer<Data>* ch = p->ch_;
+  Data* slots[64];
+  size_t n;
+  int prev_idx = 0;
+
+  while (0 < (n = ch->pull_batch(slots, 64))) {
+    for (size_t i = 0; i < n; i++) {
+      p->recv_count_ += 1;
+      if (prev_idx + 1 != slots[i]->idx_) {
+        p->seq_mismatch_++;
+      }
+      prev_idx = slots[i]->idx_;
     }
+    ch->release_batch(slots, n);
   }
-  return c;
+
+  return nullptr;
+}
+
+TEST(RingBuffer, ok_batch_consumer) {
+  Prop p;
+  const int count = 100000;
+  p.ch_ = new pm::RingBuffer<Data>();
+  p.send_count_ = count;
+
+  pthread_t t1, t2;
+  pthread_create(&t1, nullptr, batch_provider, &p);
+  pthread_create(&t2, nullptr, batch_consumer, &p);
+
+  pthread_join(t1, nullptr);
+  pthread_join(t2, nullptr);
+
+  EXPECT_EQ(p.seq_mismatch_, 0);
+  EXPECT_EQ(p.recv_count_, count);
+  delete p.ch_;
 }
 
-void* sender(void *obj) {
-  Args* args = static_cast<Args*>(obj);
-  for (int i = 0; i < 10; i++) {
-    auto d = new Data();
-    d->p_ = delay(0x2000);
-    args->q_->push(d);
+TEST(RingBuffer, pull_batch_holds_slots) {
+  pm::Config config;
+  config.set("Machine.ring_size", 16);
+  pm::RingBuffer<Data> ring(config);
+  Data* slots[16];
+  Data* taken[16];
+
+  ASSERT_EQ(15u, ring.retain_batch(slots, 16));
+  ring.push_batch(slots, 15);
+  EXPECT_EQ(8u, ring.pull_batch(taken, 8));
+  EXPECT_EQ(7u, ring.pull_batch(taken + 8, 8));
+  EXPECT_EQ(slots[0], taken[0]);
+  EXPECT_EQ(slots[14], taken[14]);
+
+  // All slots are given back to producer by release_batch().
+  ring.release_batch(taken, 15);
+  EXPECT_EQ(15u, ring.retain_batch(slots, 16));
+
+  ring.close();
+  EXPECT_EQ(0u, ring.pull_batch(taken, 8));
+}
+
+TEST(RingBuffer, wait_strategy) {
+  for (auto name : {"spin", "yield", "park"}) {
+    Prop p;
+    const int count = 100000;
+    pm::Config config;
+    config.set("Machine.ring_wait", name);
+    p.ch_ = new pm::RingBuffer<Data>(config);
+    p.send_count_ = count;
+
+    pthread_t t1, t2;
+    pthread_create(&t1, nullptr, batch_provider, &p);
+    pthread_create(&t2, nullptr, consumer, &p);
+
+    pthread_join(t1, nullptr);
+    pthread_join(t2, nullptr);
+
+    EXPECT_EQ(p.seq_mismatch_, 0);
+    EXPECT_EQ(p.recv_count_, count);
+    delete p.ch_;
   }
+}
 
-  return nullptr;
+TEST(RingBuffer, park_slow_provider) {
+  // Consumer parks while provider is slow and must be woken up by push().
+  Prop p;
+  const int count = 1000;
+  pm::Config config;
+  config.set("Machine.ring_wait", "park");
+  p.ch_ = new pm::RingBuffer<Data>(config);
+  p.send_count_ = count;
+  p.send_load_ = 0xffff;
+
+  pthread_t t1, t2;
+  pthread_create(&t1, nullptr, provider, &p);
+  pthread_create(&t2, nullptr, consumer, &p);
+
+  pthread_join(t1, nullptr);
+  pthread_join(t2, nullptr);
+
+  EXPECT_EQ(p.seq_mismatch_, 0);
+  EXPECT_EQ(p.recv_count_, count);
+  delete p.ch_;
+}
+
+TEST(RingBuffer, ring_size) {
+  pm::Config config;
+  config.set("Machine.ring_size", 10);
+  pm::RingBuffer<Data> ring(config);
+  EXPECT_EQ(16u, ring.ring_size());
+
+  // One slot is kept for data pulled last.
+  Data* slots[32];
+  EXPECT_EQ(15u, ring.retain_batch(slots, 32));
+  ring.push_batch(slots, 15);
+  EXPECT_NE(nullptr, ring.try_pull());
+  EXPECT_EQ(1u, ring.retain_batch(slots, 32));
+}
+
+TEST(RingBuffer, slot_size) {
+  pm::Config config;
+  config.set("Machine.ring_size", 16);
+  config.set("Machine.slot_size", 100);
+  pm::RingBuffer<pm::Packet> ring(config);
+
+  // Buffer is block of slab, rounded up to cache line size.
+  pm::Packet* p1 = ring.retain();
+  EXPECT_EQ(128u, p1->buf_len());
+  pm::byte_t data[256] = {1, 2, 3};
+  EXPECT_TRUE(p1->store(data, 128));
+  EXPECT_EQ(128u, p1->buf_len());
+  ring.push(p1);
+
+  // Buffers of slots are contiguous.
+  pm::Packet* p2 = ring.retain();
+  EXPECT_TRUE(p2->store(data, 64));
+  EXPECT_EQ(p1->buf() + 128, p2->buf());
+  ring.push(p2);
+
+  // Larger data than slot is stored in own buffer of Packet.
+  pm::Packet* p3 = ring.retain();
+  EXPECT_TRUE(p3->store(data, 256));
+  EXPECT_EQ(256u, p3->buf_len());
+  EXPECT_EQ(3, p3->buf()[2]);
+  ring.push(p3);
+
+  EXPECT_EQ(p1, ring.pull());
+  EXPECT_EQ(p2, ring.pull());
+  EXPECT_EQ(p3, ring.pull());
+
+  pm::Config no_slab;
+  no_slab.set("Machine.slot_size", 0);
+  pm::RingBuffer<pm::Packet> ring2(no_slab);
+  EXPECT_EQ(0u, ring2.retain()->buf_len());
+  EXPECT_FALSE(ring2.bind_node(0));
 }
 
-void* recver(void *obj) {
-  Args* args = static_cast<Args*>(obj);
-  for (int i = 0; i < 10; i++) {
-    while(!args->q_->has_msg()) {
-      args->wait_++;
+TEST(RingBuffer, bind_node) {
+  pm::Config config;
+  config.set("Machine.ring_size", 16);
+  pm::RingBuffer<pm::Packet> ring(config);
+  EXPECT_FALSE(ring.bind_node(-1));
+
+  // Binding may be refused (e.g. no NUMA support), the ring works anyway.
+  ring.bind_node(pm::Thread::cpu_node(0));
+  pm::byte_t data[64] = {1, 2, 3};
+  pm::Packet* p = ring.retain();
+  EXPECT_TRUE(p->store(data, sizeof(data)));
+  ring.push(p);
+  EXPECT_EQ(3, ring.pull()->buf()[2]);
+}
+
+TEST(Waiter, parse) {
+  pm::Waiter::Strategy s;
+  EXPECT_TRUE(pm::Waiter::parse("park", &s));
+  EXPECT_EQ(pm::Waiter::PARK, s);
+  EXPECT_TRUE(pm::Waiter::parse("sleep", &s));
+  EXPECT_EQ(pm::Waiter::SLEEP, s);
+  EXPECT_FALSE(pm::Waiter::parse("busy", &s));
+}
+
+
+// Former RingBuffer design as baseline of benchmark: both indices are on
+// same cache line, next index is computed by modulo of 0xfff and all
+// accesses are seq_cst. It spins while waiting same as Waiter::SPIN.
+class LegacyRing {
+ private:
+  std::atomic<uint32_t> push_idx_;
+  std::atomic<uint32_t> pull_idx_;
+  std::vector<Data*> ring_;
+  uint32_t ring_size_;
+  std::atomic<bool> eos_;
+
+  uint32_t next(uint32_t idx) { return (idx + 1) % this->ring_size_; }
+
+ public:
+  LegacyRing() : push_idx_(0), pull_idx_(0), ring_size_(0xfff), eos_(false) {
+    this->ring_.resize(this->ring_size_);
+    for (auto& d : this->ring_) {
+      d = new Data();
+    }
+  }
+  ~LegacyRing() {
+    for (auto d : this->ring_) {
+      delete d;
+    }
+  }
+
+  Data* retain() {
+    uint32_t n = this->next(this->push_idx_);
+    while (n == this->pull_idx_) {}
+    return this->ring_[n];
+  }
+  void push(Data* data) {
+    uint32_t n = this->next(this->push_idx_);
+    this->ring_[n] = data;
+    this->push_idx_ = n;
+  }
+  Data* pull() {
+    uint32_t n = this->next(this->pull_idx_);
+    while (n == this->next(this->push_idx_)) {
+      if (this->eos_) {
+        return nullptr;
+      }
     }
+    Data* d = this->ring_[n];
+    this->pull_idx_ = n;
+    return d;
+  }
+  void release(Data* data) {}
+  void close() { this->eos_ = true; }
+};
+
+template <typename R>
+struct Bench {
+  R* ring_;
+  int count_;
+  int recv_;
+};
 
-    auto d = args->q_->pull();
-    args->recv_++;
-    delete d;
+template <typename R>
+void* bench_provider(void* obj) {
+  Bench<R>* b = static_cast<Bench<R>*>(obj);
+  for (int i = 0; i < b->count_; i++) {
+    Data* d = b->ring_->retain();
+    d->idx_ = i;
+    b->ring_->push(d);
   }
-  
-  return nullptr;  
+  b->ring_->close();
+  return nullptr;
 }
 
+template <typename R>
+void* bench_consumer(void* obj) {
+  Bench<R>* b = static_cast<Bench<R>*>(obj);
+  Data* d;
+  while (nullptr != (d = b->ring_->pull())) {
+    b->recv_ += (d->idx_ >= 0);
+    b->ring_->release(d);
+  }
+  return nullptr;
+}
 
+double elapsed(const struct timespec& ts1, const struct timespec& ts2) {
+  return (ts2.tv_sec - ts1.tv_sec) + (ts2.tv_nsec - ts1.tv_nsec) / 1e9;
+}
 
-TEST(MsgQueue, ok){
-  pm::MsgQueue<Data*> q;
-  Args args(&q);
-  
-  pthread_t t1, t2;
-  pthread_create(&t1, nullptr, sender, &args);
-  pthread_create(&t2, nullptr, recver, &args);
+// Push and pull batch of items alternately in one thread to measure cost of
+// ring operations without thread scheduling. Return items per second.
+template <typename R>
+double bench_ring_single(R* ring, int count, int* recv) {
+  const int batch = 1024;
+  struct timespec ts1, ts2;
+  *recv = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts1);
+  for (int i = 0; i < count; i += batch) {
+    for (int j = 0; j < batch; j++) {
+      Data* d = ring->retain();
+      d->idx_ = i + j;
+      ring->push(d);
+    }
+    for (int j = 0; j < batch; j++) {
+      Data* d = ring->pull();
+      *recv += (d->idx_ == i + j);
+      ring->release(d);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts2);
 
+  return count / elapsed(ts1, ts2);
+}
+
+// Run producer and consumer threads. Return items per second.
+template <typename R>
+double bench_ring(R* ring, int count, int* recv) {
+  Bench<R> b = {ring, count, 0};
+  struct timespec ts1, ts2;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts1);
+  pthread_t t1, t2;
+  pthread_create(&t1, nullptr, bench_provider<R>, &b);
+  pthread_create(&t2, nullptr, bench_consumer<R>, &b);
   pthread_join(t1, nullptr);
   pthread_join(t2, nullptr);
+  clock_gettime(CLOCK_MONOTONIC, &ts2);
 
-  EXPECT_LT(0, args.wait_);
-  EXPECT_EQ(10, args.recv_);
+  *recv = b.recv_;
+  return count / elapsed(ts1, ts2);
 }
 
-}   // namspace msg_queue
+// Run with --gtest_also_run_disabled_tests.
+TEST(RingBuffer, DISABLED_bench_throughput) {
+  const int count = 1 << 22;
+  int recv;
+
+  LegacyRing legacy;
+  double legacy_rate = bench_ring_single(&legacy, count, &recv);
+
+  pm::RingBuffer<Data> ring;
+  double rate = bench_ring_single(&ring, count, &recv);
+  EXPECT_EQ(count, recv);
+
+  printf("RingBuffer: %.1f M items/sec (former design: %.1f M items/sec)\n",
+         rate / 1e6, legacy_rate / 1e6);
+}
+
+// Both threads spin, then run with --gtest_also_run_disabled_tests on a host
+// having two or more cores.
+TEST(RingBuffer, DISABLED_bench_throughput_threads) {
+  const int count = 1 << 24;
+  int recv;
+
+  LegacyRing legacy;
+  double legacy_rate = bench_ring(&legacy, count, &recv);
+
+  pm::Config config;
+  config.set("Machine.ring_wait", "spin");
+  pm::RingBuffer<Data> ring(config);
+  double rate = bench_ring(&ring, count, &recv);
+  EXPECT_EQ(count, recv);
+
+  printf("RingBuffer: %.1f M items/sec (former design: %.1f M items/sec)\n",
+         rate / 1e6, legacy_rate / 1e6);
+}
+
+}    // namespace ring_buffer
 
 }   // namespace channel_test
@@ -26,6 +26,9 @@
 
 #include <pcap.h>
 
+#include <set>
+#include <string>
+#include <vector>
 #include "./gtest/gtest.h"
 #include "../src/decoder.hpp"
 #include "../src/packet.hpp"
@@ -120,6 +123,126 @@ TEST(Decoder, lookup_event) {
   EXPECT_EQ(pm::Param::NONE, dec.lookup_param_id("Invalid_Param"));
 }
 
+TEST(Decoder, build_filter) {
+  pm::Decoder dec;
+  auto eid = [&](const std::string& name) {
+    return dec.lookup_event_id(name);
+  };
+
+  // Same terms for no tag, single tag and QinQ.
+  auto tagged = [](const std::string& e) {
+    return e + " or (vlan and (" + e + " or (vlan and (" + e + "))))";
+  };
+
+  const std::string dns = "(ether proto 0x8864) or (udp port 53)";
+  EXPECT_EQ(tagged(dns), dec.build_filter({eid("DNS.query")}));
+  EXPECT_EQ(tagged(dns),
+            dec.build_filter({eid("DNS.query"), eid("DNS.reply")}));
+
+  const std::string tcp_dns = "(ether proto 0x8864) or (tcp) or (udp port 53)";
+  EXPECT_EQ(tagged(tcp_dns),
+            dec.build_filter({eid("TCP.new_session"), eid("DNS.query")}));
+
+  // Ethernet can not be narrowed, and no event means no filter.
+  EXPECT_EQ("", dec.build_filter({eid("DNS.query"), eid("Ethernet")}));
+  EXPECT_EQ("", dec.build_filter({}));
+  EXPECT_THROW(dec.build_filter({pm::Event::NONE}), pm::Exception::IndexError);
+}
+
+TEST(Decoder, dispatch) {
+  // Ethernet + IPv4 + UDP 10.0.0.1:1234 -> 10.0.0.2:5300 + DNS query header
+  pm::byte_t frame[54] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x08, 0x00,
+    0x45, 0, 0, 40, 0, 0, 0, 0, 64, 17, 0, 0,
+    10, 0, 0, 1, 10, 0, 0, 2,
+    0x04, 0xd2, 0x14, 0xb4, 0, 20, 0, 0,
+    0x12, 0x34, 0x01, 0x00, 0, 0, 0, 0, 0, 0, 0, 0,
+  };
+
+  auto events = [&](pm::Decoder* dec) {
+    pm::Packet pkt;
+    pm::Payload pd;
+    pm::Property prop;
+    pkt.store(frame, sizeof(frame));
+    pd.reset(&pkt);
+    prop.init(&pkt);
+    dec->decode(&pd, &prop);
+
+    std::string names;
+    for (size_t i = 0; i < prop.event_idx(); i++) {
+      names += (i > 0 ? " " : "") +
+               dec->lookup_event_name(prop.event(i)->id());
+    }
+    return names;
+  };
+
+  pm::Decoder plain;
+  EXPECT_EQ("Ethernet IPv4 UDP", events(&plain));
+
+  pm::Config config;
+  config.set("Machine.dispatch", "udp.port:5300=DNS,ethertype:0x88a8=Dot1Q");
+  pm::Decoder dec(config);
+  EXPECT_EQ("Ethernet IPv4 UDP DNS DNS.query", events(&dec));
+  EXPECT_NE(std::string::npos,
+            dec.build_filter({dec.lookup_event_id("DNS.query")})
+            .find("(udp port 5300)"));
+
+  // If both ports are bound, the smaller one is looked up first. It is same
+  // as former precedence (DNS, MDNS, then DHCP) except for DHCP and MDNS.
+  auto ports = [&](uint16_t sport, uint16_t dport) {
+    frame[34] = sport >> 8;
+    frame[35] = sport & 0xff;
+    frame[36] = dport >> 8;
+    frame[37] = dport & 0xff;
+    return events(&plain);
+  };
+  EXPECT_EQ("Ethernet IPv4 UDP DNS DNS.query", ports(5353, 53));
+  EXPECT_EQ("Ethernet IPv4 UDP DNS DNS.query", ports(53, 5353));
+  EXPECT_EQ("Ethernet IPv4 UDP DNS DNS.query", ports(67, 53));
+  EXPECT_EQ("Ethernet IPv4 UDP DHCP", ports(5353, 68));
+  EXPECT_EQ("Ethernet IPv4 UDP MDNS MDNS.query", ports(1234, 5353));
+
+  // IPv6 is dispatched from Ethernet.
+  frame[12] = 0x86;
+  frame[13] = 0xdd;
+  EXPECT_EQ("Ethernet IPv6", events(&plain));
+
+  for (auto ng : {"udp.port:70000=DNS", "udp.port:53", "udp.port:x=DNS",
+                  "foo:1=DNS", "udp.port:53=Foo"}) {
+    pm::Config conf;
+    conf.set("Machine.dispatch", ng);
+    EXPECT_THROW(pm::Decoder d(conf), pm::Exception::ConfigError) << ng;
+  }
+}
+
+TEST(Decoder, needed_modules) {
+  pm::Decoder dec;
+  auto needed = [&](const std::vector<std::string>& events) {
+    std::vector<pm::event_id> ids;
+    for (const auto& ev : events) {
+      ids.push_back(dec.lookup_event_id(ev));
+    }
+    std::set<std::string> mods;
+    auto flags = dec.needed_modules(ids);
+    for (const auto& name : {"Ethernet", "Dot1Q", "PPPoE", "ARP", "IPv4",
+                             "IPv6", "UDP", "TCP", "ICMP", "DNS", "MDNS",
+                             "DHCP"}) {
+      if (flags[dec.lookup_module(name)]) {
+        mods.insert(name);
+      }
+    }
+    return mods;
+  };
+
+  EXPECT_EQ(std::set<std::string>({"Ethernet"}), needed({"Ethernet"}));
+  EXPECT_EQ(std::set<std::string>({"Ethernet", "Dot1Q", "ARP"}),
+            needed({"ARP.request"}));
+  EXPECT_EQ(std::set<std::string>({"Ethernet", "Dot1Q", "PPPoE", "IPv4",
+                                   "IPv6", "UDP", "DNS"}),
+            needed({"DNS.query"}));
+  EXPECT_EQ(std::set<std::string>(), needed({}));
+}
+
 
 TEST(Decoder, custom_module) {
   class DummyMod : public pm::Module {
@@ -245,6 +368,63 @@ TEST(Decoder, batch_param) {
   EXPECT_EQ("cd", prop.value("Ethernet.p.2").repr());
 }
 
+TEST(Decoder, lazy_param) {
+  class DummyMod : public pm::Module {
+   public:
+    const pm::ParamDef* p1_;
+    pm::MajorParamDef* p_;
+
+    DummyMod () {
+      this->p1_ = this->define_param("p1");
+      this->p_ = this->define_major_param("p");
+      this->p_->define_minor("2", [](pm::Value* v, const pm::byte_t* ptr) {
+          v->set(&ptr[2], 2);
+        });
+    }
+    void setup(const pm::Config& config) {}
+    pm::mod_id decode(pm::Payload* pd, pm::Property* prop) {
+      const pm::byte_t* p = pd->retain(4);
+      if (p[0] == 'a') {
+        prop->set_value(this->p1_, &p[0], 2);
+        prop->set_value(this->p1_, &p[2], 2);   // ignored.
+      }
+      prop->set_value(this->p_, p, 4);
+      return pm::Module::NONE;
+    };
+  };
+
+  pm::ModMap mod_map;
+  pm::Packet pkt;
+  pm::Payload pd;
+  pm::Property prop;
+  auto mod = new DummyMod();
+  mod_map.insert(std::make_pair("Ethernet", mod));
+
+  std::shared_ptr<pm::Decoder> dec(new pm::Decoder(&mod_map));
+  prop.set_decoder(dec);
+
+  std::string data("abcdefg");
+  pkt.store(reinterpret_cast<const pm::byte_t*>(data.data()), 4);
+  pd.reset(&pkt);
+  prop.init(&pkt);
+  dec->decode(&pd, &prop);
+
+  EXPECT_TRUE(prop.has_value("Ethernet.p1"));
+  EXPECT_EQ("ab", prop.value("Ethernet.p1").repr());
+  EXPECT_EQ("ab", prop.value("Ethernet.p1").repr());
+  EXPECT_EQ("cd", prop.value("Ethernet.p.2").repr());
+
+  // Values recorded for the previous packet must not remain.
+  std::string data2("xyzw");
+  pkt.store(reinterpret_cast<const pm::byte_t*>(data2.data()), 4);
+  pd.reset(&pkt);
+  prop.init(&pkt);
+  dec->decode(&pd, &prop);
+
+  EXPECT_FALSE(prop.has_value("Ethernet.p1"));
+  EXPECT_EQ("zw", prop.value("Ethernet.p.2").repr());
+}
+
 TEST(Decoder, config_test) {
   class DummyMod1 : public pm::Module {
    public:
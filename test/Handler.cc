@@ -25,6 +25,7 @@
  */
 
 #include <unistd.h>
+#include <vector>
 #include "./gtest/gtest.h"
 #include "../src/packetmachine.hpp"
 
@@ -161,5 +162,73 @@ TEST(Handler, clear_async) {
   delete m;
 }
 
+TEST(Handler, churn) {
+  // Handlers are added and destroyed for each packet while decoding.
+  pm::Machine *m = new pm::Machine();
+  std::vector<pm::Handler> hdlrs;
+  int count = 0, dyn_count = 0;
+  m->on("UDP", [&](const pm::Property& p) {
+      count++;
+      if (!hdlrs.empty()) {
+        EXPECT_TRUE(hdlrs.back().destroy());
+      }
+      hdlrs.push_back(m->on("UDP", [&](const pm::Property& p) {
+            dyn_count++;
+          }));
+    });
+
+  m->add_pcapfile("./test/data2.pcap");
+  m->start();
+  // Also from other thread.
+  for (int i = 0; i < 500; i++) {
+    pm::Handler h = m->on("IPv4", [](const pm::Property& p) {});
+    EXPECT_TRUE(h.destroy());
+    EXPECT_FALSE(h.destroy());
+  }
+  m->join();
+
+  ASSERT_LT(0, count);
+  EXPECT_EQ(static_cast<size_t>(count), hdlrs.size());
+  EXPECT_GE(count, dyn_count);
+  for (size_t i = 0; i + 1 < hdlrs.size(); i++) {
+    EXPECT_FALSE(hdlrs[i].is_active());
+  }
+  EXPECT_TRUE(hdlrs.back().is_active());
+  delete m;
+}
+
+TEST(Handler, dispatch_order) {
+  // Handlers of an event are called in order of registration, and events
+  // of a packet are dispatched in decoding order.
+  pm::Machine *m = new pm::Machine();
+  std::vector<int> seq;
+  m->on("UDP", [&](const pm::Property& p) { seq.push_back(2); });
+  m->on("Ethernet", [&](const pm::Property& p) { seq.push_back(0); });
+  pm::Handler h = m->on("UDP", [&](const pm::Property& p) {
+      seq.push_back(-1);
+    });
+  m->on("UDP", [&](const pm::Property& p) { seq.push_back(3); });
+  m->on("Ethernet", [&](const pm::Property& p) { seq.push_back(1); });
+  EXPECT_TRUE(h.deactivate());
+
+  m->add_pcapfile("./test/data2.pcap");
+  m->loop();
+
+  size_t udp = 0;
+  for (size_t i = 0; i < seq.size(); i++) {
+    EXPECT_NE(-1, seq[i]);
+    if (seq[i] == 0) {
+      ASSERT_LT(i + 1, seq.size());
+      EXPECT_EQ(1, seq[i + 1]);
+    } else if (seq[i] == 2) {
+      ASSERT_LT(i + 1, seq.size());
+      EXPECT_EQ(3, seq[i + 1]);
+      EXPECT_EQ(1, seq[i - 1]);
+      udp++;
+    }
+  }
+  EXPECT_LT(0u, udp);
+  delete m;
+}
 
 }   // namespace machine_test
@@ -24,6 +24,10 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/time.h>
+#include <atomic>
+#include <string>
+#include <vector>
 #include "./gtest/gtest.h"
 #include "../src/packetmachine.hpp"
 
@@ -50,4 +54,459 @@ TEST(Machine, start_and_halt) {
   delete m;
 }
 
+TEST(Machine, file_workers) {
+  std::atomic<uint64_t> count(0), size(0);
+  pm::Config config;
+  config.set("Machine.file_workers", 4);
+
+  pm::Machine *m = new pm::Machine(config);
+  m->on("Ethernet", [&](const pm::Property& p) {
+      count++;
+      size += p.pkt_size();
+    });
+  m->add_pcapfile("./test/data2.pcap");
+  m->loop();
+
+  pm::Machine *s = new pm::Machine();
+  s->add_pcapfile("./test/data2.pcap");
+  s->loop();
+
+  EXPECT_LT(0u, s->recv_pkt());
+  EXPECT_EQ(s->recv_pkt(),  m->recv_pkt());
+  EXPECT_EQ(s->recv_size(), m->recv_size());
+  EXPECT_EQ(s->recv_pkt(),  count);
+  EXPECT_EQ(s->recv_size(), size);
+  delete m;
+  delete s;
+}
+
+TEST(Machine, workers) {
+  for (auto file : {"./test/data2.pcap", "./test/data3.pcap"}) {
+    std::atomic<uint64_t> count(0), size(0), session(0), plain_session(0);
+    pm::Config config;
+    config.set("Machine.workers", 3);
+
+    pm::Machine *m = new pm::Machine(config);
+    m->on("Ethernet", [&](const pm::Property& p) {
+        count++;
+        size += p.pkt_size();
+      });
+    m->on("TCP.new_session", [&](const pm::Property& p) { session++; });
+    m->add_pcapfile(file);
+    m->loop();
+
+    pm::Machine *s = new pm::Machine();
+    s->on("TCP.new_session", [&](const pm::Property& p) { plain_session++; });
+    s->add_pcapfile(file);
+    s->loop();
+
+    // Both directions of a TCP session are decoded by one worker.
+    EXPECT_LT(0u, s->recv_pkt());
+    EXPECT_EQ(s->recv_pkt(),  m->recv_pkt());
+    EXPECT_EQ(s->recv_size(), m->recv_size());
+    EXPECT_EQ(s->recv_pkt(),  count);
+    EXPECT_EQ(s->recv_size(), size);
+    EXPECT_EQ(plain_session, session);
+    delete m;
+    delete s;
+  }
+
+  pm::Config zero;
+  zero.set("Machine.workers", 0);
+  EXPECT_THROW(new pm::Machine(zero), pm::Exception::ConfigError);
+  pm::Config both;
+  both.set("Machine.workers", 2);
+  both.set("Machine.file_workers", 2);
+  EXPECT_THROW(new pm::Machine(both), pm::Exception::ConfigError);
+}
+
+TEST(Machine, ng_file_workers_with_stateful_event) {
+  pm::Config config;
+  config.set("Machine.file_workers", 2);
+  pm::Machine m(config);
+
+  EXPECT_THROW(m.on("TCP.new_session", [](const pm::Property& p) {}),
+               pm::Exception::ConfigError);
+  EXPECT_NO_THROW(m.on("TCP", [](const pm::Property& p) {}));
+
+  pm::Config ssn;
+  ssn.set("Machine.file_workers", 2);
+  ssn.set_true("TCP.enable_session_mgmt");
+  EXPECT_THROW(new pm::Machine(ssn), pm::Exception::ConfigError);
+}
+
+TEST(Machine, file_workers_with_tcp) {
+  for (auto file : {"./test/data2.pcap", "./test/data3.pcap"}) {
+    // Results are kept per worker without lock and merged after loop().
+    const size_t n = 4;
+    std::vector<uint64_t> tcp(n, 0), data(n, 0);
+    pm::Config config;
+    config.set("Machine.file_workers", static_cast<int>(n));
+
+    pm::Machine *m = new pm::Machine(config);
+    m->on("TCP", [&](const pm::Property& p) {
+        ASSERT_GT(n, p.worker());
+        tcp[p.worker()]++;
+        if (p.has_value("TCP.data")) {
+          data[p.worker()]++;
+        }
+      });
+    m->add_pcapfile(file);
+    m->loop();
+
+    uint64_t plain_tcp = 0, plain_data = 0;
+    pm::Machine *s = new pm::Machine();
+    s->on("TCP", [&](const pm::Property& p) {
+        EXPECT_EQ(0u, p.worker());
+        plain_tcp++;
+        if (p.has_value("TCP.data")) {
+          plain_data++;
+        }
+      });
+    s->add_pcapfile(file);
+    s->loop();
+
+    uint64_t tcp_sum = 0, data_sum = 0;
+    for (size_t i = 0; i < n; i++) {
+      tcp_sum += tcp[i];
+      data_sum += data[i];
+    }
+
+    // All TCP segments are decoded, but TCP.data from partial sessions is
+    // never set.
+    EXPECT_LT(0u, plain_data);
+    EXPECT_EQ(plain_tcp, tcp_sum);
+    EXPECT_EQ(0u, data_sum);
+    delete m;
+    delete s;
+  }
+}
+
+TEST(Machine, ng_invalid_machine_config) {
+  pm::Config config;
+  config.set("Machine.no_such_key", 1);
+  EXPECT_THROW(new pm::Machine(config), pm::Exception::ConfigError);
+
+  pm::Config zero;
+  zero.set("Machine.file_workers", 0);
+  EXPECT_THROW(new pm::Machine(zero), pm::Exception::ConfigError);
+}
+
+TEST(Machine, multiple_sources) {
+  pm::Machine *s2 = new pm::Machine();
+  s2->add_pcapfile("./test/data2.pcap");
+  s2->loop();
+  pm::Machine *s3 = new pm::Machine();
+  s3->add_pcapfile("./test/data3.pcap");
+  s3->loop();
+
+  pm::Machine *m = new pm::Machine();
+  struct timeval prev = {0, 0};
+  int disorder = 0;
+  m->on("Ethernet", [&](const pm::Property& p) {
+      if (timercmp(&p.tv(), &prev, <)) {
+        disorder++;
+      }
+      prev = p.tv();
+    });
+  m->add_pcapfile("./test/data3.pcap");
+  m->add_pcapfile("./test/data2.pcap");
+  m->add_pcapfile("./test/data2.pcap");
+  m->loop();
+
+  EXPECT_EQ(s2->recv_pkt() * 2 + s3->recv_pkt(), m->recv_pkt());
+  EXPECT_EQ(s2->recv_size() * 2 + s3->recv_size(), m->recv_size());
+  EXPECT_EQ(0, disorder);
+  delete m;
+  delete s2;
+  delete s3;
+}
+
+TEST(Machine, ng_add_source_after_start) {
+  pm::Machine *m = new pm::Machine();
+  m->add_pcapfile("./test/data2.pcap");
+  m->start();
+  EXPECT_THROW(m->add_pcapfile("./test/data3.pcap"),
+               pm::Exception::ConfigError);
+  m->join();
+  delete m;
+}
+
+TEST(Machine, bpf_filter) {
+  // Count DNS packets without filter.
+  pm::Machine *all = new pm::Machine();
+  uint64_t dns_pkt = 0;
+  all->on("UDP", [&](const pm::Property& p) {
+      if (p.value("UDP.src_port").uint() == 53 ||
+          p.value("UDP.dst_port").uint() == 53) {
+        dns_pkt++;
+      }
+    });
+  all->add_pcapfile("./test/data2.pcap");
+  all->loop();
+
+  pm::Config config;
+  config.set("Machine.bpf_filter", "udp port 53");
+  pm::Machine *m = new pm::Machine(config);
+  m->add_pcapfile("./test/data2.pcap");
+  m->loop();
+
+  EXPECT_LT(0u, dns_pkt);
+  EXPECT_GT(all->recv_pkt(), m->recv_pkt());
+  EXPECT_EQ(dns_pkt, m->recv_pkt());
+  delete m;
+  delete all;
+}
+
+TEST(Machine, auto_filter) {
+  uint64_t query[2] = {0, 0};
+  uint64_t recv[2];
+
+  for (int i = 0; i < 2; i++) {
+    pm::Config config;
+    if (i == 1) {
+      config.set_true("Machine.auto_filter");
+    }
+    pm::Machine *m = new pm::Machine(config);
+    m->on("DNS.query", [&](const pm::Property& p) { query[i]++; });
+    m->add_pcapfile("./test/data2.pcap");
+    m->loop();
+    recv[i] = m->recv_pkt();
+    delete m;
+  }
+
+  // Only packets that can be DNS are decoded and no query is lost.
+  EXPECT_LT(0u, query[0]);
+  EXPECT_EQ(query[0], query[1]);
+  EXPECT_GT(recv[0], recv[1]);
+}
+
+TEST(Machine, ng_invalid_filter) {
+  pm::Config config;
+  config.set("Machine.bpf_filter", "udp port !!");
+  pm::Machine *m = new pm::Machine(config);
+  m->add_pcapfile("./test/data2.pcap");
+  EXPECT_THROW(m->start(), pm::Exception::ConfigError);
+  delete m;
+}
+
+TEST(Machine, event_wait) {
+  // File can not be waited on, then it is read as before.
+  pm::Machine *plain = new pm::Machine();
+  plain->add_pcapfile("./test/data2.pcap");
+  plain->loop();
+
+  pm::Config config;
+  config.set_true("Machine.event_wait");
+  config.set("Machine.busy_poll", 100);
+  pm::Machine *m = new pm::Machine(config);
+  m->add_pcapfile("./test/data2.pcap");
+  m->loop();
+
+  EXPECT_EQ(plain->recv_pkt(), m->recv_pkt());
+  delete m;
+  delete plain;
+
+  pm::Config ng;
+  ng.set("Machine.busy_poll", -1);
+  EXPECT_THROW(new pm::Machine(ng), pm::Exception::ConfigError);
+}
+
+TEST(Machine, ring_wait) {
+  pm::Machine *plain = new pm::Machine();
+  plain->add_pcapfile("./test/data2.pcap");
+  plain->add_pcapfile("./test/data3.pcap");
+  plain->loop();
+
+  for (auto name : {"spin", "yield", "park"}) {
+    pm::Config config;
+    config.set("Machine.ring_wait", name);
+    pm::Machine *m = new pm::Machine(config);
+    m->add_pcapfile("./test/data2.pcap");
+    m->add_pcapfile("./test/data3.pcap");
+    m->loop();
+    EXPECT_EQ(plain->recv_pkt(), m->recv_pkt());
+    delete m;
+  }
+  delete plain;
+
+  pm::Config ng;
+  ng.set("Machine.ring_wait", "busy");
+  EXPECT_THROW(new pm::Machine(ng), pm::Exception::ConfigError);
+}
+
+TEST(Machine, ring_size) {
+  pm::Machine *plain = new pm::Machine();
+  plain->add_pcapfile("./test/data2.pcap");
+  plain->loop();
+
+  pm::Config config;
+  config.set("Machine.ring_size", 16);
+  config.set("Machine.slot_size", 256);
+  config.set_true("Machine.huge_page");
+  pm::Machine *m = new pm::Machine(config);
+  m->add_pcapfile("./test/data2.pcap");
+  m->loop();
+  EXPECT_EQ(plain->recv_pkt(), m->recv_pkt());
+  EXPECT_EQ(plain->recv_size(), m->recv_size());
+  delete m;
+  delete plain;
+
+  pm::Config ng1;
+  ng1.set("Machine.ring_size", 100);
+  EXPECT_THROW(new pm::Machine(ng1), pm::Exception::ConfigError);
+  pm::Config ng2;
+  ng2.set("Machine.slot_size", -1);
+  EXPECT_THROW(new pm::Machine(ng2), pm::Exception::ConfigError);
+}
+
+TEST(Machine, async_handler) {
+  // Asynchronous callbacks see same values as synchronous ones, including
+  // values referring memory other than packet data (e.g. TCP.data).
+  std::vector<std::string> sync_values, async_values;
+  auto to_str = [](const pm::Property& p) {
+    return p["IPv4.src"].repr() + " " + p["TCP.data"].hex() + " " +
+        std::to_string(p.pkt_size());
+  };
+
+  pm::Config config;
+  config.set("Machine.async_queue", 4);
+  pm::Machine *m = new pm::Machine(config);
+  m->on("TCP", [&](const pm::Property& p) {
+      sync_values.push_back(to_str(p));
+    });
+  m->on("TCP", [&](const pm::Property& p) {
+      usleep(10);
+      async_values.push_back(to_str(p));
+    }, true);
+  m->add_pcapfile("./test/data2.pcap");
+  m->loop();
+
+  EXPECT_LT(0u, sync_values.size());
+  EXPECT_EQ(sync_values, async_values);
+  EXPECT_EQ(0u, m->async_drop());
+  delete m;
+
+  // Slow asynchronous callback does not stall decoding with drop policy.
+  std::atomic<uint64_t> sync_count(0), async_count(0);
+  pm::Config drop;
+  drop.set("Machine.async_queue", 4);
+  drop.set("Machine.async_overflow", "drop");
+  pm::Machine *d = new pm::Machine(drop);
+  d->on("Ethernet", [&](const pm::Property& p) { sync_count++; });
+  d->on("Ethernet", [&](const pm::Property& p) {
+      usleep(1000);
+      async_count++;
+    }, true);
+  d->add_pcapfile("./test/data2.pcap");
+  d->loop();
+
+  EXPECT_EQ(d->recv_pkt(), sync_count);
+  EXPECT_LT(0u, d->async_drop());
+  EXPECT_EQ(d->recv_pkt(), async_count + d->async_drop());
+  delete d;
+
+  pm::Config ng1;
+  ng1.set("Machine.async_queue", 3);
+  EXPECT_THROW(new pm::Machine(ng1), pm::Exception::ConfigError);
+  pm::Config ng2;
+  ng2.set("Machine.async_overflow", "sample");
+  EXPECT_THROW(new pm::Machine(ng2), pm::Exception::ConfigError);
+}
+
+TEST(Machine, prune_decode) {
+  pm::Config config;
+  config.set_true("Machine.prune_decode");
+
+  // Same events are triggered with pruning.
+  for (auto ev : {"Ethernet", "UDP", "DNS.query", "TCP.new_session"}) {
+    int count = 0, pruned_count = 0;
+    pm::Machine *m = new pm::Machine();
+    m->on(ev, [&](const pm::Property& p) { count++; });
+    m->add_pcapfile("./test/data2.pcap");
+    m->loop();
+
+    pm::Machine *p = new pm::Machine(config);
+    p->on(ev, [&](const pm::Property& p) { pruned_count++; });
+    p->add_pcapfile("./test/data2.pcap");
+    p->loop();
+
+    EXPECT_EQ(count, pruned_count) << ev;
+    EXPECT_EQ(m->recv_pkt(), p->recv_pkt());
+    delete m;
+    delete p;
+  }
+
+  // Modules under Ethernet are not decoded.
+  int ipv4 = 0;
+  pm::Machine *p = new pm::Machine(config);
+  p->on("Ethernet", [&](const pm::Property& p) {
+      if (p.has_value("IPv4.src")) {
+        ipv4++;
+      }
+    });
+  p->add_pcapfile("./test/data2.pcap");
+  p->loop();
+  EXPECT_LT(0u, p->recv_pkt());
+  EXPECT_EQ(0, ipv4);
+  delete p;
+}
+
+TEST(Machine, affinity) {
+  pm::Machine *plain = new pm::Machine();
+  plain->add_pcapfile("./test/data2.pcap");
+  plain->loop();
+
+  pm::Config config;
+  config.set("Machine.workers", 2);
+  config.set("Machine.input_cpus", "0");
+  config.set("Machine.kernel_cpus", "0,0");
+  pm::Machine *m = new pm::Machine(config);
+  m->add_pcapfile("./test/data2.pcap");
+  m->loop();
+  EXPECT_EQ(plain->recv_pkt(), m->recv_pkt());
+  delete m;
+  delete plain;
+
+  for (auto cpus : {"", "a", "-1", "0,", "1-0", "0-1x", "100000"}) {
+    pm::Config ng;
+    ng.set("Machine.kernel_cpus", cpus);
+    EXPECT_THROW(new pm::Machine(ng), pm::Exception::ConfigError);
+  }
+  pm::Config ng;
+  ng.set("Machine.rt_priority", 100);
+  EXPECT_THROW(new pm::Machine(ng), pm::Exception::ConfigError);
+}
+
+TEST(Machine, drop_policy) {
+  pm::Machine *plain = new pm::Machine();
+  plain->add_pcapfile("./test/data2.pcap");
+  plain->loop();
+  EXPECT_EQ(0u, plain->drop_pkt());
+
+  // Slow decoding with small ring. Every packet read is decoded or counted
+  // as dropped.
+  for (auto policy : {"drop", "sample"}) {
+    pm::Config config;
+    config.set("Machine.ring_size", 16);
+    config.set("Machine.drop_policy", policy);
+    config.set("Machine.sample_rate", 4);
+    pm::Machine *m = new pm::Machine(config);
+    m->on("Ethernet", [](const pm::Property& p) { usleep(100); });
+    m->add_pcapfile("./test/data2.pcap");
+    m->loop();
+    EXPECT_LT(0u, m->drop_pkt());
+    EXPECT_EQ(plain->recv_pkt(), m->recv_pkt() + m->drop_pkt());
+    delete m;
+  }
+  delete plain;
+
+  pm::Config ng1;
+  ng1.set("Machine.drop_policy", "tail");
+  EXPECT_THROW(new pm::Machine(ng1), pm::Exception::ConfigError);
+  pm::Config ng2;
+  ng2.set("Machine.sample_rate", 0);
+  EXPECT_THROW(new pm::Machine(ng2), pm::Exception::ConfigError);
+}
+
 }   // namespace machine_test
@@ -28,6 +28,7 @@
 #include "./gtest/gtest.h"
 
 #include "../src/packet.hpp"
+#include "../src/flow.hpp"
 
 TEST(Packet, store) {
   pm::byte_t a[] = {1, 2, 3, 4, 5};
@@ -54,3 +55,119 @@ TEST(Packet, store) {
   EXPECT_EQ(100u, tv_s.tv_sec);
   EXPECT_EQ(200u, tv_s.tv_usec);
 }
+
+namespace packet_test {
+
+class Lender : public pm::PacketLender {
+ public:
+  int count_;
+  uint64_t tag_;
+  Lender() : count_(0), tag_(0) {}
+  void give_back(const pm::Packet* pkt) {
+    this->count_++;
+    this->tag_ = pkt->tag();
+  }
+};
+
+TEST(Packet, lend) {
+  pm::byte_t a[] = {1, 2, 3, 4, 5};
+  pm::Packet pkt;
+  Lender lender;
+
+  pkt.lend(a, 5, &lender, 3);
+  EXPECT_TRUE(pkt.is_lent());
+  EXPECT_EQ(a, pkt.buf());
+  EXPECT_EQ(5u, pkt.len());
+  EXPECT_EQ(3u, pkt.tag());
+
+  pkt.release();
+  EXPECT_FALSE(pkt.is_lent());
+  EXPECT_EQ(1, lender.count_);
+  EXPECT_EQ(3u, lender.tag_);
+
+  // release twice does not give back the data again.
+  pkt.release();
+  EXPECT_EQ(1, lender.count_);
+}
+
+TEST(Packet, store_after_lend) {
+  pm::byte_t a[] = {1, 2, 3, 4, 5};
+  pm::byte_t b[] = {6, 7, 8};
+  pm::Packet pkt;
+  Lender lender;
+
+  pkt.lend(a, 5, &lender);
+  pkt.store(b, 3);
+  EXPECT_FALSE(pkt.is_lent());
+  EXPECT_EQ(1, lender.count_);
+  EXPECT_NE(b, pkt.buf());
+  EXPECT_EQ(3u, pkt.len());
+  EXPECT_EQ(6u, pkt.buf()[0]);
+}
+
+TEST(Packet, swap) {
+  pm::byte_t a[] = {1, 2, 3, 4, 5};
+  pm::byte_t b[] = {6, 7, 8};
+  pm::Packet p1, p2;
+  Lender lender;
+
+  p1.lend(a, 5, &lender, 3);
+  p2.store(b, 3);
+  const pm::byte_t* buf2 = p2.buf();
+
+  p1.swap(&p2);
+  EXPECT_FALSE(p1.is_lent());
+  EXPECT_EQ(buf2, p1.buf());
+  EXPECT_EQ(3u, p1.len());
+  EXPECT_TRUE(p2.is_lent());
+  EXPECT_EQ(a, p2.buf());
+  EXPECT_EQ(3u, p2.tag());
+
+  p2.release();
+  EXPECT_EQ(1, lender.count_);
+}
+
+TEST(Packet, flow_hash) {
+  // Ethernet + IPv4 + UDP 10.0.0.1:1234 -> 10.0.0.2:53
+  pm::byte_t req[42] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x08, 0x00,
+    0x45, 0, 0, 28, 0, 0, 0, 0, 64, 17, 0, 0,
+    10, 0, 0, 1, 10, 0, 0, 2,
+    0x04, 0xd2, 0x00, 0x35, 0, 8, 0, 0,
+  };
+  // Reply: swapped addresses and ports.
+  pm::byte_t rep[42];
+  ::memcpy(rep, req, sizeof(req));
+  ::memcpy(rep + 26, req + 30, 4);
+  ::memcpy(rep + 30, req + 26, 4);
+  ::memcpy(rep + 34, req + 36, 2);
+  ::memcpy(rep + 36, req + 34, 2);
+
+  const uint32_t h = pm::flow_hash(req, sizeof(req));
+  EXPECT_NE(0u, h);
+  EXPECT_EQ(h, pm::flow_hash(rep, sizeof(rep)));
+
+  // Other source port is other flow.
+  rep[34] = 0x05;
+  EXPECT_NE(h, pm::flow_hash(rep, sizeof(rep)));
+
+  // Non-first fragment does not have ports, first one has same hash.
+  pm::byte_t frag[42];
+  ::memcpy(frag, req, sizeof(req));
+  frag[20] = 0x00;
+  frag[21] = 0x10;
+  const uint32_t fh = pm::flow_hash(frag, sizeof(frag));
+  frag[20] = 0x20;   // MF flag
+  frag[21] = 0x00;
+  EXPECT_EQ(fh, pm::flow_hash(frag, sizeof(frag)));
+
+  // Not IP and truncated frame.
+  pm::byte_t arp[42];
+  ::memcpy(arp, req, sizeof(req));
+  arp[12] = 0x08;
+  arp[13] = 0x06;
+  EXPECT_EQ(0u, pm::flow_hash(arp, sizeof(arp)));
+  EXPECT_EQ(0u, pm::flow_hash(req, 20));
+}
+
+}   // namespace packet_test
@@ -81,3 +81,39 @@ TEST(PcapFile, ng_invalid_format) {
   EXPECT_EQ(pfile->error(), "pcap is not ready");
   delete pfile;
 }
+
+TEST(PcapFile, read_batch) {
+  pm::PcapFile *pfile = new pm::PcapFile("./test/data2.pcap");
+  pm::PcapFile *bfile = new pm::PcapFile("./test/data2.pcap");
+  ASSERT_TRUE(pfile->ready());
+  ASSERT_TRUE(bfile->ready());
+
+  pm::Packet pkt;
+  int count = 0;
+  while (pm::Capture::OK == (pfile->read(&pkt))) {
+    count += 1;
+  }
+
+  pm::Packet slots[16];
+  pm::Packet* pkts[16];
+  for (size_t i = 0; i < 16; i++) {
+    pkts[i] = &slots[i];
+  }
+
+  size_t n;
+  int batch_count = 0;
+  pm::Capture::Result rc;
+  while (pm::Capture::OK == (rc = bfile->read_batch(pkts, 16, &n))) {
+    EXPECT_LT(0u, n);
+    EXPECT_GE(16u, n);
+    batch_count += n;
+  }
+
+  EXPECT_EQ(pm::Capture::EXIT, rc);
+  EXPECT_EQ(0u, n);
+  EXPECT_TRUE(bfile->error().empty());
+  EXPECT_LT(0, count);
+  EXPECT_EQ(count, batch_count);
+  delete pfile;
+  delete bfile;
+}
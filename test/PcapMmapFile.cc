@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2017 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp> All
+ * rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "./gtest/gtest.h"
+#include "../src/capture.hpp"
+#include "../src/packet.hpp"
+
+namespace pcap_mmap_file_test {
+
+TEST(PcapMmapFile, same_as_pcap_file) {
+  pm::PcapMmapFile *mfile = new pm::PcapMmapFile("./test/data2.pcap");
+  pm::PcapFile *pfile = new pm::PcapFile("./test/data2.pcap");
+  ASSERT_TRUE(mfile->ready());
+  ASSERT_TRUE(pfile->ready());
+
+  pm::Packet mpkt, ppkt;
+  int count = 0, mismatch = 0;
+  pm::Capture::Result rc;
+  while (pm::Capture::OK == (rc = mfile->read(&mpkt))) {
+    ASSERT_EQ(pm::Capture::OK, pfile->read(&ppkt));
+    count += 1;
+
+    if (mpkt.len() != ppkt.len() ||
+        ::memcmp(mpkt.buf(), ppkt.buf(), mpkt.len()) != 0 ||
+        mpkt.tv().tv_sec != ppkt.tv().tv_sec ||
+        mpkt.tv().tv_usec != ppkt.tv().tv_usec) {
+      mismatch += 1;
+    }
+  }
+
+  EXPECT_EQ(pm::Capture::EXIT, rc);
+  EXPECT_EQ(pm::Capture::EXIT, pfile->read(&ppkt));
+  EXPECT_TRUE(mfile->error().empty());
+  EXPECT_LT(0, count);
+  EXPECT_EQ(0, mismatch);
+  delete mfile;
+  delete pfile;
+}
+
+TEST(PcapMmapFile, read_batch) {
+  pm::PcapMmapFile *mfile = new pm::PcapMmapFile("./test/data2.pcap");
+  pm::PcapFile *pfile = new pm::PcapFile("./test/data2.pcap");
+  ASSERT_TRUE(mfile->ready());
+
+  pm::Packet slots[16];
+  pm::Packet* pkts[16];
+  for (size_t i = 0; i < 16; i++) {
+    pkts[i] = &slots[i];
+  }
+
+  pm::Packet ppkt;
+  size_t n;
+  int count = 0, mismatch = 0;
+  pm::Capture::Result rc;
+  while (pm::Capture::OK == (rc = mfile->read_batch(pkts, 16, &n))) {
+    for (size_t i = 0; i < n; i++) {
+      ASSERT_EQ(pm::Capture::OK, pfile->read(&ppkt));
+      if (pkts[i]->len() != ppkt.len() ||
+          ::memcmp(pkts[i]->buf(), ppkt.buf(), ppkt.len()) != 0) {
+        mismatch += 1;
+      }
+    }
+    count += n;
+  }
+
+  // EXIT is returned again after end of file.
+  EXPECT_EQ(pm::Capture::EXIT, rc);
+  EXPECT_EQ(pm::Capture::EXIT, mfile->read_batch(pkts, 16, &n));
+  EXPECT_EQ(0u, n);
+  EXPECT_EQ(pm::Capture::EXIT, pfile->read(&ppkt));
+  EXPECT_LT(0, count);
+  EXPECT_EQ(0, mismatch);
+  delete mfile;
+  delete pfile;
+}
+
+TEST(PcapMmapFile, split) {
+  pm::PcapMmapFile *mfile = new pm::PcapMmapFile("./test/data2.pcap");
+  pm::PcapFile *pfile = new pm::PcapFile("./test/data2.pcap");
+  ASSERT_TRUE(mfile->ready());
+
+  std::vector<pm::PcapMmapFile*> readers = mfile->split(4);
+  ASSERT_EQ(3u, readers.size());
+  readers.insert(readers.begin(), mfile);
+
+  // Ranges must be contiguous and keep original packet order.
+  pm::Packet mpkt, ppkt;
+  int count = 0, mismatch = 0;
+  for (auto r : readers) {
+    int n = 0;
+    while (pm::Capture::OK == r->read(&mpkt)) {
+      ASSERT_EQ(pm::Capture::OK, pfile->read(&ppkt));
+      n += 1;
+      if (mpkt.len() != ppkt.len() ||
+          ::memcmp(mpkt.buf(), ppkt.buf(), mpkt.len()) != 0) {
+        mismatch += 1;
+      }
+    }
+    EXPECT_LT(0, n);
+    EXPECT_TRUE(r->error().empty());
+    count += n;
+  }
+
+  EXPECT_EQ(pm::Capture::EXIT, pfile->read(&ppkt));
+  EXPECT_LT(0, count);
+  EXPECT_EQ(0, mismatch);
+
+  for (auto r : readers) {
+    delete r;
+  }
+  delete pfile;
+}
+
+TEST(PcapMmapFile, ng_no_such_file) {
+  pm::PcapMmapFile *mfile = new pm::PcapMmapFile("./test/no_such_file.pcap");
+  ASSERT_FALSE(mfile->ready());
+  EXPECT_EQ(mfile->error(),
+            "./test/no_such_file.pcap: No such file or directory");
+
+  pm::Packet pkt;
+  EXPECT_EQ(mfile->read(&pkt), pm::Capture::ERROR);
+  EXPECT_EQ(mfile->error(), "pcap is not ready");
+  delete mfile;
+}
+
+TEST(PcapMmapFile, ng_invalid_format) {
+  // Open file that is not a pcap format file.
+  pm::PcapMmapFile *mfile = new pm::PcapMmapFile("./test/main.cc");
+  ASSERT_FALSE(mfile->ready());
+  EXPECT_EQ(mfile->error(), "unknown file format");
+  delete mfile;
+}
+
+
+class Writer {
+ public:
+  std::vector<uint8_t> buf_;
+  void u8(uint8_t v) { this->buf_.push_back(v); }
+  void u16(uint16_t v) { this->raw(&v, sizeof(v)); }
+  void u32(uint32_t v) { this->raw(&v, sizeof(v)); }
+  void raw(const void* p, size_t len) {
+    auto b = static_cast<const uint8_t*>(p);
+    this->buf_.insert(this->buf_.end(), b, b + len);
+  }
+  bool save(const char* path) {
+    FILE* fp = ::fopen(path, "wb");
+    if (fp == nullptr) {
+      return false;
+    }
+    ::fwrite(this->buf_.data(), 1, this->buf_.size(), fp);
+    ::fclose(fp);
+    return true;
+  }
+};
+
+TEST(PcapMmapFile, pcapng) {
+  const uint8_t data[] = {1, 2, 3, 4, 5, 6};
+  Writer w;
+
+  // Section Header Block
+  w.u32(0x0a0d0d0a); w.u32(28); w.u32(0x1a2b3c4d);
+  w.u16(1); w.u16(0); w.u32(0xffffffff); w.u32(0xffffffff); w.u32(28);
+
+  // Interface Description Block with if_tsresol = 10^-9
+  w.u32(1); w.u32(32); w.u16(1); w.u16(0); w.u32(0xffff);
+  w.u16(9); w.u16(1); w.u8(9); w.u8(0); w.u8(0); w.u8(0);
+  w.u16(0); w.u16(0); w.u32(32);
+
+  // Name Resolution Block, should be skipped.
+  w.u32(4); w.u32(16); w.u16(0); w.u16(0); w.u32(16);
+
+  // Enhanced Packet Block, 6 byte data with 2 byte padding.
+  uint64_t ts = 1500000000ULL * 1000000000ULL + 123456789ULL;
+  w.u32(6); w.u32(40); w.u32(0);
+  w.u32(static_cast<uint32_t>(ts >> 32));
+  w.u32(static_cast<uint32_t>(ts));
+  w.u32(6); w.u32(60);
+  w.raw(data, sizeof(data)); w.u16(0); w.u32(40);
+
+  // Simple Packet Block
+  w.u32(3); w.u32(24); w.u32(6);
+  w.raw(data, sizeof(data)); w.u16(0); w.u32(24);
+
+  char path[] = "/tmp/pm_pcapng_XXXXXX";
+  int fd = ::mkstemp(path);
+  ASSERT_LE(0, fd);
+  ::close(fd);
+  ASSERT_TRUE(w.save(path));
+
+  pm::PcapMmapFile *mfile = new pm::PcapMmapFile(path);
+  ASSERT_TRUE(mfile->ready());
+
+  pm::Packet pkt;
+  ASSERT_EQ(pm::Capture::OK, mfile->read(&pkt));
+  EXPECT_EQ(6u, pkt.len());
+  EXPECT_EQ(0, ::memcmp(data, pkt.buf(), sizeof(data)));
+  EXPECT_EQ(1500000000, pkt.tv().tv_sec);
+  EXPECT_EQ(123456, pkt.tv().tv_usec);
+
+  ASSERT_EQ(pm::Capture::OK, mfile->read(&pkt));
+  EXPECT_EQ(6u, pkt.len());
+  EXPECT_EQ(6u, pkt.buf()[5]);
+
+  EXPECT_EQ(pm::Capture::EXIT, mfile->read(&pkt));
+  EXPECT_TRUE(mfile->error().empty());
+
+  delete mfile;
+  ::unlink(path);
+}
+
+}   // namespace pcap_mmap_file_test
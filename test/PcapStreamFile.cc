@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2017 Masayoshi Mizutani <mizutani@sfc.wide.ad.jp> All
+ * rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#ifdef PACKETMACHINE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef PACKETMACHINE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef PACKETMACHINE_LZ4
+#include <lz4frame.h>
+#endif
+#include "./gtest/gtest.h"
+#include "../src/capture.hpp"
+#include "../src/packet.hpp"
+#include "../src/packetmachine.hpp"
+
+namespace pcap_stream_file_test {
+
+static std::vector<uint8_t> load(const char* path) {
+  std::vector<uint8_t> buf;
+  FILE* fp = ::fopen(path, "rb");
+  if (fp) {
+    uint8_t tmp[4096];
+    size_t n;
+    while (0 < (n = ::fread(tmp, 1, sizeof(tmp), fp))) {
+      buf.insert(buf.end(), tmp, tmp + n);
+    }
+    ::fclose(fp);
+  }
+  return buf;
+}
+
+static void save(const char* path, const void* data, size_t len) {
+  FILE* fp = ::fopen(path, "wb");
+  ASSERT_NE(nullptr, fp);
+  ::fwrite(data, 1, len, fp);
+  ::fclose(fp);
+}
+
+// Compare packets of compressed file with original file.
+static void compare(const char* path, const pm::Config& config) {
+  pm::PcapStreamFile *sfile = new pm::PcapStreamFile(path, config);
+  pm::PcapFile *pfile = new pm::PcapFile("./test/data2.pcap");
+  ASSERT_TRUE(sfile->ready());
+  ASSERT_TRUE(pfile->ready());
+
+  pm::Packet slots[16];
+  pm::Packet* pkts[16];
+  for (size_t i = 0; i < 16; i++) {
+    pkts[i] = &slots[i];
+  }
+
+  pm::Packet ppkt;
+  size_t n;
+  int count = 0, mismatch = 0;
+  pm::Capture::Result rc;
+  while (pm::Capture::EXIT != (rc = sfile->read_batch(pkts, 16, &n))) {
+    ASSERT_NE(pm::Capture::ERROR, rc);
+    for (size_t i = 0; i < n; i++) {
+      ASSERT_EQ(pm::Capture::OK, pfile->read(&ppkt));
+      if (pkts[i]->len() != ppkt.len() ||
+          ::memcmp(pkts[i]->buf(), ppkt.buf(), ppkt.len()) != 0 ||
+          pkts[i]->tv().tv_sec != ppkt.tv().tv_sec ||
+          pkts[i]->tv().tv_usec != ppkt.tv().tv_usec) {
+        mismatch += 1;
+      }
+      // Give back the chunk for next decompression.
+      pkts[i]->release();
+    }
+    count += n;
+  }
+
+  EXPECT_EQ(pm::Capture::EXIT, sfile->read_batch(pkts, 16, &n));
+  EXPECT_EQ(pm::Capture::EXIT, pfile->read(&ppkt));
+  EXPECT_TRUE(sfile->error().empty());
+  EXPECT_LT(0, count);
+  EXPECT_EQ(0, mismatch);
+  delete sfile;
+  delete pfile;
+}
+
+#ifdef PACKETMACHINE_ZLIB
+
+static void save_gzip(const char* path, const std::vector<uint8_t>& data) {
+  gzFile gz = gzopen(path, "wb");
+  ASSERT_NE(nullptr, gz);
+  gzwrite(gz, data.data(), static_cast<unsigned>(data.size()));
+  gzclose(gz);
+}
+
+TEST(PcapStreamFile, gzip) {
+  const char* path = "./test/stream_test.pcap.gz";
+  auto data = load("./test/data2.pcap");
+  ASSERT_LT(0u, data.size());
+  save_gzip(path, data);
+
+  EXPECT_TRUE(pm::PcapStreamFile::is_compressed(path));
+  EXPECT_FALSE(pm::PcapStreamFile::is_compressed("./test/data2.pcap"));
+
+  // Default chunks hold whole file.
+  compare(path, pm::Config());
+
+  // Small chunks, then records cross chunk boundaries and chunks are reused.
+  pm::Config config;
+  config.set("chunk_size", 1000);
+  config.set("chunk_count", 3);
+  compare(path, config);
+  ::unlink(path);
+}
+
+TEST(PcapStreamFile, machine) {
+  const char* path = "./test/stream_test.pcap.gz";
+  save_gzip(path, load("./test/data2.pcap"));
+
+  pm::Machine *plain = new pm::Machine();
+  plain->add_pcapfile("./test/data2.pcap");
+  plain->loop();
+
+  pm::Machine *m = new pm::Machine();
+  m->add_pcapfile(path);
+  m->loop();
+
+  EXPECT_LT(0u, m->recv_pkt());
+  EXPECT_EQ(plain->recv_pkt(), m->recv_pkt());
+  EXPECT_EQ(plain->recv_size(), m->recv_size());
+  delete m;
+  delete plain;
+  ::unlink(path);
+}
+
+TEST(PcapStreamFile, ng_truncated) {
+  const char* gz_path = "./test/stream_test.pcap.gz";
+  save_gzip(gz_path, load("./test/data2.pcap"));
+  auto gz = load(gz_path);
+
+  const char* path = "./test/stream_test_truncated.pcap.gz";
+  save(path, gz.data(), gz.size() / 2);
+
+  pm::Config config;
+  config.set("chunk_size", 4096);
+  pm::PcapStreamFile *sfile = new pm::PcapStreamFile(path, config);
+  ASSERT_TRUE(sfile->ready());
+
+  pm::Packet pkt;
+  pm::Capture::Result rc;
+  int count = 0;
+  while (pm::Capture::OK == (rc = sfile->read(&pkt)) ||
+         pm::Capture::NONE == rc) {
+    count += (rc == pm::Capture::OK) ? 1 : 0;
+  }
+  EXPECT_EQ(pm::Capture::ERROR, rc);
+  EXPECT_FALSE(sfile->error().empty());
+  EXPECT_LT(0, count);
+
+  delete sfile;
+  ::unlink(path);
+  ::unlink(gz_path);
+}
+
+TEST(PcapStreamFile, ng_invalid_record_length) {
+  // Break caplen of 3rd record.
+  auto data = load("./test/data2.pcap");
+  uint32_t magic;
+  ::memcpy(&magic, data.data(), sizeof(magic));
+  ASSERT_EQ(0xa1b2c3d4, magic);
+
+  size_t offset = 24;
+  for (int i = 0; i < 2; i++) {
+    uint32_t caplen;
+    ASSERT_GT(data.size(), offset + 16);
+    ::memcpy(&caplen, data.data() + offset + 8, sizeof(caplen));
+    offset += 16 + caplen;
+  }
+  const uint32_t broken = 0x7fffffff;
+  ASSERT_GT(data.size(), offset + 16);
+  ::memcpy(data.data() + offset + 8, &broken, sizeof(broken));
+
+  const char* path = "./test/stream_test_broken.pcap.gz";
+  save_gzip(path, data);
+
+  pm::Config config;
+  config.set("chunk_size", 4096);
+  pm::PcapStreamFile *sfile = new pm::PcapStreamFile(path, config);
+  ASSERT_TRUE(sfile->ready());
+
+  pm::Packet pkt;
+  pm::Capture::Result rc;
+  int count = 0;
+  while (pm::Capture::OK == (rc = sfile->read(&pkt)) ||
+         pm::Capture::NONE == rc) {
+    if (rc == pm::Capture::OK) {
+      count += 1;
+      pkt.release();
+    }
+  }
+  EXPECT_EQ(pm::Capture::ERROR, rc);
+  EXPECT_EQ("invalid record length", sfile->error());
+  EXPECT_EQ(2, count);
+  // Error is kept.
+  EXPECT_EQ(pm::Capture::ERROR, sfile->read(&pkt));
+
+  delete sfile;
+  ::unlink(path);
+}
+
+TEST(PcapStreamFile, ng_invalid_format) {
+  // Compressed file that is not a pcap format file.
+  const char* path = "./test/stream_test.txt.gz";
+  save_gzip(path, load("./test/main.cc"));
+
+  pm::PcapStreamFile *sfile = new pm::PcapStreamFile(path);
+  ASSERT_FALSE(sfile->ready());
+  EXPECT_EQ(sfile->error(), "unknown file format");
+  delete sfile;
+  ::unlink(path);
+}
+
+#endif   // PACKETMACHINE_ZLIB
+
+#ifdef PACKETMACHINE_ZSTD
+
+TEST(PcapStreamFile, zstd) {
+  const char* path = "./test/stream_test.pcap.zst";
+  auto data = load("./test/data2.pcap");
+  std::vector<uint8_t> buf(ZSTD_compressBound(data.size()));
+  size_t len = ZSTD_compress(buf.data(), buf.size(), data.data(), data.size(),
+                             1);
+  ASSERT_FALSE(ZSTD_isError(len));
+  save(path, buf.data(), len);
+
+  pm::Config config;
+  config.set("chunk_size", 1000);
+  config.set("chunk_count", 3);
+  compare(path, config);
+  ::unlink(path);
+}
+
+#endif   // PACKETMACHINE_ZSTD
+
+#ifdef PACKETMACHINE_LZ4
+
+TEST(PcapStreamFile, lz4) {
+  const char* path = "./test/stream_test.pcap.lz4";
+  auto data = load("./test/data2.pcap");
+  std::vector<uint8_t> buf(LZ4F_compressFrameBound(data.size(), nullptr));
+  size_t len = LZ4F_compressFrame(buf.data(), buf.size(), data.data(),
+                                  data.size(), nullptr);
+  ASSERT_FALSE(LZ4F_isError(len));
+  save(path, buf.data(), len);
+
+  pm::Config config;
+  config.set("chunk_size", 1000);
+  config.set("chunk_count", 3);
+  compare(path, config);
+  ::unlink(path);
+}
+
+#endif   // PACKETMACHINE_LZ4
+
+TEST(PcapStreamFile, ng_not_compressed) {
+  pm::PcapStreamFile *sfile = new pm::PcapStreamFile("./test/data2.pcap");
+  ASSERT_FALSE(sfile->ready());
+  EXPECT_EQ(sfile->error(), "unknown file format");
+  delete sfile;
+}
+
+TEST(PcapStreamFile, ng_no_such_file) {
+  pm::PcapStreamFile *sfile =
+      new pm::PcapStreamFile("./test/no_such_file.pcap.gz");
+  ASSERT_FALSE(sfile->ready());
+  EXPECT_EQ(sfile->error(),
+            "./test/no_such_file.pcap.gz: No such file or directory");
+
+  pm::Packet pkt;
+  EXPECT_EQ(sfile->read(&pkt), pm::Capture::ERROR);
+  EXPECT_EQ(sfile->error(), "pcap is not ready");
+  delete sfile;
+}
+
+}   // namespace pcap_stream_file_test